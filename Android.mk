@@ -21,17 +21,26 @@ LOCAL_SRC_FILES := \
     conf/config.cpp \
     impl/cd9660.cpp \
     impl/device.cpp \
+    impl/adopt.cpp \
+    impl/worker.cpp \
+    impl/lower.cpp \
+    impl/uring.cpp \
     impl/strdec.cpp \
     impl/strenc.cpp \
     impl/source.cpp \
     impl/unique.cpp \
     impl/rlimit.cpp \
+    impl/shards.cpp \
+    impl/simd.cpp \
+    impl/spill.cpp \
     impl/burner.cpp \
     impl/extent.cpp \
+    impl/fixup.cpp \
     impl/vfat32.cpp \
     impl/datetm.cpp \
     impl/volume.cpp \
     impl/hfplus.cpp \
+    impl/inodes.cpp \
     impl/master.cpp \
     impl/mapper.cpp \
     impl/attrib.cpp
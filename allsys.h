@@ -52,11 +52,13 @@ namespace {}
 // must follow sys/mount.h (kernel and glibc header coordination issue)
 // see: https://bugzilla.redhat.com/show_bug.cgi?id=1497501
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #include <getopt.h>
 #include <sys/utsname.h>
 
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
 
@@ -64,6 +66,19 @@ namespace {}
 /// The file exists until it's closed by all the processes that use it.
 static inline int memfd_open( const char * name, unsigned int flags ) { return syscall( SYS_memfd_create, name, flags ); }
 
+/// Flush the filesystem containing the open file, as syncfs() does (in bionic since API 28 only).
+static inline int sync_filesystem( int fd ) { return syscall( SYS_syncfs, fd ); }
+
+/// Write gathered buffers at an offset, as pwritev64() does (in bionic since API 24 only).
+/// The kernel takes the offset as two halves; a 64-bit kernel ignores the high one.
+static inline ssize_t pwrite_vector( int fd, const struct iovec * iov, int count, off64_t at )
+{ return syscall( SYS_pwritev, fd, iov, count, ( unsigned long ) at, ( unsigned long )( ( uint64_t ) at >> 32 ) ); }
+
+/// Exempt the blocks of an F2FS file from garbage collection (from linux/f2fs.h, which is recent).
+#ifndef F2FS_IOC_SET_PIN_FILE
+#define F2FS_IOC_SET_PIN_FILE _IOW( 0xf5, 13, __u32 )
+#endif
+
 #if defined(ANDROID) || defined(__ANDROID__)
 #include <sys/system_properties.h>
 #else
@@ -66,17 +66,18 @@ void ConfCb::expectAtoi( const char * name, OnAtoi onAtoi )
 
 void ConfCb::expectAtol( const char * name, long & lIntVal )
 {
-    expectAtol( name, [&lIntVal]( int number ) { lIntVal = number; } );
+    expectAtol( name, [&lIntVal]( long number ) { lIntVal = number; } );
 }
 
 void ConfCb::expectAtol( const char * name, OnAtol onAtol )
 {
-    expectAttr( name, [onAtol]( char * value )
-    {
-        char * endPtr = nullptr;
-        onAtol( strtol( value, &endPtr, 0 )
-                * multiplier( endPtr ) );
-    } );
+    expectAttr( name, [onAtol]( char * value ) { onAtol( Atol( value ) ); } );
+}
+
+long ConfCb::Atol( const char * value )
+{
+    char * endPtr = nullptr;
+    return strtol( value, &endPtr, 0 ) * multiplier( endPtr );
 }
 
 void ConfCb::expectAttr( const char * name, const char *& lAttr )
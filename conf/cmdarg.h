@@ -56,6 +56,9 @@ struct ConfCb
     void fname( const char * name, T * ptr, void( T::*func )( atype ) ) \
     { fname( name, BIND(fname, atype) ); }
 
+    /// Parse a long integer value with an optional size suffix ("1k", "64m", "4g").
+    static long Atol( const char * value );
+
     BIND_EXPECT( expectAttr, char * )
     BIND_EXPECT( expectAtoi, int )
     BIND_EXPECT( expectAtol, long )
@@ -54,6 +54,12 @@ void MkfsConf::mkfs( MkfsConf::FSType fs )
     }
 }
 
+const char * MkfsConf::label( FSType type ) const
+{
+    auto itr = labels.find( type );
+    return itr == labels.end() ? "" : itr->second.c_str();
+}
+
 void MkfsConf::substitute( const char * found, const char * used )
 {
     subst.push_back( { found, used } );
@@ -96,6 +102,12 @@ MkfsConf::MkfsConf()
     expectAttr( "tmp", buffer );
     expectAttr( "zram-control", zrControl ); // use a temp file if undefined
 
+    // Unmappable extent hosting
+    expectAtol( "adopt", adopt_budget );
+    expectAttr( "adopt-tmp", adopt_tmp );
+    expectAttr( "adopt-control", adopt_control );
+    expectAtol( "adopt-workers", adopt_workers );
+
     // Output format(s)
     fs_opt.expectFlag( "files", [this]() { mkfs( FS_Files ); } );
     fs_opt.expectFlag( "fat32", [this]() { mkfs( FS_Fat32 ); } );
@@ -112,14 +124,46 @@ MkfsConf::MkfsConf()
     ds_opt.onOther = [this]( const char * key, const char * value ) { substitute( key, value ); };
     expectAttr( "subst", &ds_opt, &SubOpt::parse );
 
+    // Stacked filesystem prefixes
+    lw_opt.onOther = [this]( const char * key, const char * value )
+    {
+        if( !value ) { printf( "Lower path must be upper=lower\n" ); abort(); }
+        lower.push_back( { key, value } );
+    };
+    expectAttr( "lower", &lw_opt, &SubOpt::parse );
+
+    // Sharding
+    expectAtoi( "shards", shards );
+    sh_opt.expectFlag( "folder", [this]() { shard_by_date = false; } );
+    sh_opt.expectFlag( "date", [this]() { shard_by_date = true; } );
+    expectAttr( "shard-by", &sh_opt, &SubOpt::parse );
+
     // Correlation
     expectFlag( "jam-inodes", inode_jam );
+    expectAttr( "inode-map", [this]( const char * path ) { inode_map = path; inode_jam = true; } );
 
     // Reorganization (relevance: FAT)
     expectAtol( "gap", extent_gap );
+    dg_opt.onOther = [this]( const char * key, const char * value )
+    {
+        unsigned long major, minor;
+        if( !value || sscanf( key, "%lx:%lx", &major, &minor ) != 2 )
+        { printf( "Device gap must be major:minor=size\n" ); abort(); }
+        dev_gaps[makedev( major, minor )] = Atol( value );
+    };
+    expectAttr( "dev-gap", &dg_opt, &SubOpt::parse );
     expectAtoi( "lanes", [this]( int lanes ) { setLanes( lanes ); } );
     expectFlag( "wipe-dust", star_dust );
 
+    // Output parallelism
+    expectAtol( "jobs", jobs );
+    expectFlag( "uring", uring );
+    expectAtol( "dedup-targets", dedup_targets );
+    expectFlag( "plan-only", plan_only );
+    expectAtol( "max-memory", max_memory );
+    expectAttr( "spill", spill );
+    expectAttr( "isa", isa );
+
     // Miscellaneous options
     expectFlag( "crawl", crawl_fds );
     expectFlag( "memfd", use_memfd );
@@ -166,4 +210,5 @@ TempConf::TempConf()
     expectAtol( "size", size );
     expectAttr( "root", root );
     expectAttr( "label", vLabel );
+    expectAttr( "isa", isa );
 }
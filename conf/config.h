@@ -85,6 +85,8 @@ struct MkfsConf : public CtrlConf
 
     /// Volume labels: values
     std::map<int, std::string> labels;
+    /// Return the label of the filesystem type (empty if undefined).
+    const char * label( FSType type ) const;
 
     /// Output (values, required); control nodes (values, optional)
     // --out=(disk name ("virtualcd") or file path ("/...")) # gso-tokenized!
@@ -108,16 +110,41 @@ struct MkfsConf : public CtrlConf
     void mapDevices( std::function<dev_t ( const char * )> locate,
                      std::function<void( dev_t, dev_t )> put ) const;
 
-    /// Inode translation: flag
+    /// Stacked filesystems (FUSE, sdcardfs): resolve the extents of the lower files
+    // --lower=/storage/emulated=/data/media (sdcardfs prefixes are read from mountinfo)
+    std::list<std::pair<const char *, const char *>> lower;
+
+    /// Sharding: value, suboptions
+    // --shards=4 # split the tree into 4 volumes built concurrently
+    // --shard-by=(folder|date) # top-level entry order [ default: folder ]
+    int shards = 1;
+    bool shard_by_date = false;
+    // each shard gets its own target: "virtualcd" -> "virtualcd0", "virtualcd1"...
+    // --tmp and --zram-control accept a comma-separated per-shard list.
+
+    /// Adoption of unmappable (encrypted, inline, unallocated) extents: values
+    // --adopt=256M # copy up to 256M per volume to a ZRam device [ default: 0, zeros ]
+    // --adopt-tmp=/dev/block/zram2 # required with --adopt; a per-shard list, as --tmp
+    // --adopt-control=/sys/block/zram2 # required with --adopt; a per-shard list
+    // --adopt-workers=4 # copy threads [ default: one per CPU core ]
+    long adopt_budget = 0;
+    const char * adopt_tmp = nullptr;
+    const char * adopt_control = nullptr;
+    long adopt_workers = 0;
+
+    /// Inode translation: flag, value
     bool inode_jam = false;
-    // --jam-inodes (obfuscate or allocate sequentially) **
-    // [ default: 1:1 w/ conflict resolutions ]
-    // [ multiple drives are leaking in lazily: use top bits ]
+    // --jam-inodes (tell reused inode numbers apart by their generation)
+    // [ default: 1:1 w/ stable conflict resolutions ]
+    // --inode-map=/data/fsview/cnid.map (remember ids across rebuilds; implies --jam-inodes)
+    const char * inode_map = nullptr;
 
     /// Cost analysis and optimization: value, flag
     // --gap=1G extent merging
     off64_t extent_gap = -1;
     off64_t tolerance();
+    // --dev-gap=179:65=0,253:0=1G per-device overrides (major:minor in hex, as in --subst)
+    std::map<dev_t, off64_t> dev_gaps;
 
     // --lanes=2 # laning (FAT32) **
     // --lanes=4 # extreme laning
@@ -127,6 +154,22 @@ struct MkfsConf : public CtrlConf
     // --wipe-dust # pack small extents together **
     bool star_dust = false;
 
+    /// Output: value
+    // --jobs=4 # threads writing each image [ default: one per CPU core; 1: serial ]
+    long jobs = 0;
+    // --uring # write through io_uring (falls back to --jobs threads if unavailable)
+    bool uring = false;
+    // --max-memory=512M # heap budget; over it, directory images go to the spill file [ default: unlimited ]
+    off64_t max_memory = 0;
+    // --spill=/data/fsview # the directory of the spill file [ default: a memfd ]
+    const char * spill = nullptr;
+    // --plan-only # lay the volume out without writing anything; print the media sizes as key=value
+    bool plan_only = false;
+    // --dedup-targets=0 # extra mapper targets for constant metadata blocks [ default: 1024; 0: write them all ]
+    long dedup_targets = 1024;
+    // --isa=avx2 # vector instructions generating the FAT/bitmaps [ default: the widest supported; scalar: reference ]
+    const char * isa = nullptr;
+
     /// Miscellaneous:
     // --crawl - close FDs asap (& not raise the limit) **
     bool crawl_fds = false;
@@ -149,6 +192,9 @@ private:
     SubOpt in_opt;
     SubOpt ex_opt;
     SubOpt ok_opt;
+    SubOpt sh_opt;
+    SubOpt dg_opt;
+    SubOpt lw_opt;
 };
 
 /// Configuration of fsview_fork, the utility that mirrors another device
@@ -175,6 +221,7 @@ struct TempConf : public CtrlConf
 
     bool sparse = false;
     off64_t size = 3 << 17; // ~400k
+    const char * isa = nullptr; // as in MkfsConf
 
     TempConf();
 };
@@ -20,115 +20,237 @@
 #include "impl/strenc.h"
 #include "impl/source.h"
 #include "impl/device.h"
+#include "impl/lower.h"
 #include "impl/burner.h"
 #include "impl/cd9660.h"
 #include "impl/vfat32.h"
 #include "impl/hfplus.h"
 #include "conf/config.h"
 #include "impl/unique.h"
+#include "impl/shards.h"
+#include "impl/simd.h"
+#include "impl/spill.h"
 
 #include <iostream>
 #include <regex>
+#include <thread>
 
 // should not be included by high-level app code,
 // but only by concrete component implementations
 // -include "allsys.h"
 
-// - actually support multiple drives!
-// - jam inodes (that is, remember ino_t and resolve inode conflicts)
 // - actually crawl (close files, reopen on demand) [optional]
 // - use memfds instead of reallocated mem
 // - laaaaaning... (that's gonna take long)
 //
 
+namespace
+{
+
+/// Create the adoption engine of the index-th shard, on its own ZRam device.
+/// (Only mapped targets adopt: copied targets copy the files wholesale.)
+Ptr<Adopter> Foster( const MkfsConf & cfg, const Shards & shards, size_t index )
+{
+    std::string storage = shards.pick( cfg.adopt_tmp, index, false );
+    std::string control = shards.pick( cfg.adopt_control, index, false );
+    if( storage.empty() || control.empty() ) // a memfd can't be mapped
+    { printf( "Adoption for shard %lu requires a ZRam device\n", index ); abort(); }
+
+    Ptr<Burner> fosterImage = New<ZRAMBurner>( storage.c_str(), control.c_str() );
+    return New<Adopter>( fosterImage, cfg.adopt_budget, cfg.adopt_workers );
+}
+
+/// Traverse the source tree (or its index-th shard) and locate the file extents.
+void Scan( MkfsConf & cfg, Original & tree, const Shards & shards, size_t index )
+{
+    tree.gap = cfg.tolerance();
+    tree.gaps = cfg.dev_gaps;
+    tree.decoder = New<UTF8Homebrew>();
+    tree.generations = cfg.inode_jam;
+    if( cfg.ex.size() )
+    {
+        std::list<std::regex> patterns;
+        for( const char * expr : cfg.ex ) { patterns.emplace_back( expr ); }
+        tree.allowName = [patterns]( const char * name )
+        {
+            for( auto & pattern : patterns )
+            { if( std::regex_match( name, pattern ) ) { return false; } }
+            return true;
+        };
+    }
+    if( shards.size() > 1 )
+    {
+        tree.allowTop = [&shards, index]( const RawDirEnt * entry )
+        {
+            return shards.owner( entry->d_name ) == index;
+        };
+    }
+
+    // we allow running without cfg.target, simply to analyze the file geometry
+    if( !cfg.isTargetCopied() )
+    {
+        Ptr<ExtentIoc> locator = New<ExtentIoc>( cfg );
+        if( cfg.target && cfg.adopt_budget > 0 && !cfg.plan_only ) { locator->foster( Foster( cfg, shards, index ) ); }
+
+        // files on FUSE or sdcardfs are located on the lower filesystem
+        Ptr<LowerLocator> stacked = New<LowerLocator>( locator );
+        for( auto & prefix : cfg.lower ) { stacked->map( prefix.first, prefix.second ); }
+        stacked->scanMounts();
+        tree.locator = stacked;
+    }
+
+    auto itr = cfg.entries.begin();
+    tree.openRoot( *itr++ );
+    // supplementary files and folders (all go to the first shard)
+    for( ; itr != cfg.entries.end() && !index; ++itr )
+    { tree.fsRoot->insertStat( *itr ); }
+    tree.settle();
+
+    printf( "Files: %lu\n", tree.fileTable.size() );
+    tree.report();
+}
+
+/// Lay out the scanned tree on the target, using the temporary medium for metadata.
+void Build( MkfsConf & cfg, Original & tree, const char * target,
+            const char * buffer, const char * zrControl, const char * inodeMap )
+{
+    Ptr<Burner> outImage, tmpImage;
+    Ptr<CountBurner> outCount, tmpCount;
+
+    bool pinned = buffer && buffer[0] == '/' && !zrControl;
+    if( cfg.isTargetMapped() && !zrControl && !pinned )
+    { printf( "A mapped target needs a ZRam device or a file for its metadata\n" ); abort(); }
+
+    // differentiated based on whether the control node is provided!
+    if( cfg.plan_only ) // stand-ins: a ZRam device (or a file system) has page-sized blocks
+    { tmpImage = tmpCount = New<CountBurner>( cfg.isTargetMapped() ? sysconf( _SC_PAGESIZE ) : 1, zrControl ); }
+    else if( zrControl && buffer )
+    { tmpImage = New<ZRAMBurner>( buffer, zrControl ); }
+    else if( pinned && cfg.isTargetMapped() ) // mapped in place, rather than copied
+    { tmpImage = New<PinnedBurner>( buffer, New<ExtentIoc>( cfg ) ); } // a locator that never adopts
+    else if( pinned ) // ensure absolute
+    { tmpImage = New<FileBurner>( buffer ); }
+    else // memfd
+    { tmpImage = New<TempBurner>(); }
+
+    // differentiated based on whether the file path is absolute
+    if( cfg.plan_only )
+    { outImage = outCount = New<CountBurner>( cfg.isTargetMapped() ? Blocks::MAPPER_BS : 1, cfg.isTargetMapped() ); }
+    else if( cfg.isTargetMapped() )
+    { outImage = New<DiskBurner>( target, cfg.dmControl ); }
+    else
+    { outImage = New<FileBurner>( target ); }
+
+    auto tagVolume = [&cfg]( Volume & vol, MkfsConf::FSType type )
+    {
+        vol.setTitles( cfg.system, cfg.label( type ) );
+        vol.setJobs( cfg.jobs );
+        vol.setUring( cfg.uring );
+        vol.setDedup( std::max( cfg.dedup_targets, 0L ) );
+    };
+    CD::CD9660Out iso; tagVolume( iso, MkfsConf::FS_CDFS );
+    HP::HFPlusOut mac; tagVolume( mac, MkfsConf::FS_HFSX );
+    mac.setInodeMap( inodeMap );
+    VF::VFat32Out fat; tagVolume( fat, MkfsConf::FS_Fat32 );
+
+    Volume * out;
+    if( cfg.fsType & MkfsConf::FS_CDFS )
+    {
+        if( cfg.fsType & MkfsConf::FS_HFSX )
+        { iso.setHybrid( mac ); }
+        out = &iso;
+    }
+    else if( cfg.fsType & MkfsConf::FS_HFSX )
+    { out = &mac; }
+    else if( cfg.fsType & MkfsConf::FS_Fat32 )
+    {
+        out = &fat;
+        // a mild version of bestBlkSize() in fsview_temp.cpp
+        if( !cfg.isTargetMapped() && out->blockSize() < 2048u )
+        { out->setBlockSize( 2048u ); }
+    }
+    else if( !cfg.fsType )
+    { printf( "No filesystem requested\n" ); abort(); }
+    else
+    { printf( "Unsupported filesystem!\n" ); abort(); }
+
+    out->represent( tree, outImage, tmpImage );
+    if( !cfg.plan_only ) { return; }
+
+    // one printf() per volume keeps the lines of concurrent shards together
+    printf( "plan.target=%s\n"
+            "plan.out.size=%ld\n"
+            "plan.out.extents=%lu\n"
+            "plan.out.holes=%lu\n"
+            "plan.out.written=%ld\n"
+            "plan.tmp.size=%ld\n"
+            "plan.tmp.extents=%lu\n"
+            "plan.tmp.written=%ld\n",
+            target, outCount->offset(), outCount->extents(), outCount->holes(), outCount->written(),
+            tmpCount->reserved(), tmpCount->extents(), tmpCount->written() );
+}
+
+} // namespace
+
 int main( int argc, char ** argv )
 {
     MkfsConf cfg;
     cfg.parse( argc, argv );
+    if( cfg.isa && !Simd::Select( cfg.isa ) ) { printf( "Unsupported instruction set: %s\n", cfg.isa ); abort(); }
+    printf( "Vector instructions: %s\n", Simd::Name( Simd::Current() ) );
+    Spill::Configure( cfg.max_memory, cfg.spill );
 
     if( cfg.entries.size() ) // folder to index
     {
         if( !cfg.crawl_fds ) { RaiseFdLimit(); }
 
-        Original tree;
-        tree.gap = cfg.tolerance();
-        tree.decoder = New<UTF8Homebrew>();
-        if( cfg.ex.size() )
+        Shards shards;
+        if( cfg.shards > 1 )
         {
-            std::list<std::regex> patterns;
-            for( const char * expr : cfg.ex ) { patterns.emplace_back( expr ); }
-            tree.allowName = [patterns]( const char * name )
-            {
-                for( auto & pattern : patterns )
-                { if( std::regex_match( name, pattern ) ) { return false; } }
-                return true;
-            };
+            shards.partition( cfg.entries.front(), cfg.shards,
+                              cfg.shard_by_date ? Shards::ByDate : Shards::ByFolder );
         }
 
-        // we allow running without cfg.target, simply to analyze the file geometry
-        if( !cfg.isTargetCopied() ) { tree.locator = New<ExtentIoc>( cfg ); }
+        // the trees hold the file descriptors, so they live until we exit
+        std::vector<Original> trees( shards.size() );
+        auto work = [&]( size_t index )
+        {
+            Original & tree = trees[index];
+            Scan( cfg, tree, shards, index );
+            if( !cfg.target ) { return; }
 
-        auto itr = cfg.entries.begin();
-        tree.openRoot( *itr++ );
-        // supplementary files and folders
-        while( itr != cfg.entries.end() )
-        { tree.fsRoot->insertStat( *itr++ ); }
+            // each shard gets its own target device and its own temporary medium
+            std::string target = shards.name( cfg.target, index );
+            std::string buffer = shards.pick( cfg.buffer, index, !cfg.zrControl );
+            std::string zrControl = shards.pick( cfg.zrControl, index, false );
+            std::string inodeMap = cfg.inode_map && !cfg.plan_only ? shards.name( cfg.inode_map, index ) : "";
+            if( cfg.zrControl && ( buffer.empty() || zrControl.empty() ) )
+            { printf( "No ZRam device for shard %lu\n", index ); abort(); }
 
-        printf( "Files: %lu\n", tree.fileTable.size() );
-        printf( "Backing devices: %lu\n", tree.plan.size() );
+            Build( cfg, tree, target.c_str(),
+                   buffer.empty() ? nullptr : buffer.c_str(),
+                   zrControl.empty() ? nullptr : zrControl.c_str(),
+                   inodeMap.empty() ? nullptr : inodeMap.c_str() );
+        };
 
-        if( cfg.target )
+        if( shards.size() > 1 )
         {
-            Ptr<Burner> outImage, tmpImage;
-
-            if( cfg.isTargetMapped() && !cfg.zrControl )
-            { printf( "DM without ZRam not yet supported\n" ); abort(); } // TODO
-
-            // differentiated based on whether the control node is provided!
-            if( cfg.zrControl && cfg.buffer )
-            { tmpImage = New<ZRAMBurner>( cfg.buffer, cfg.zrControl ); }
-            else if( cfg.buffer && cfg.buffer[0] == '/' ) // ensure absolute
-            { tmpImage = New<FileBurner>( cfg.buffer ); }
-            else // memfd
-            { tmpImage = New<TempBurner>(); }
-
-            // differentiated based on whether the file path is absolute
-            if( cfg.isTargetMapped() )
-            { outImage = New<DiskBurner>( cfg.target, cfg.dmControl ); }
-            else
-            { outImage = New<FileBurner>( cfg.target ); }
-
-            auto tagVolume = [&cfg]( Volume & vol, MkfsConf::FSType type )
-            {
-                vol.setTitles( cfg.system, cfg.labels[type].c_str() );
-            };
-            CD::CD9660Out iso; tagVolume( iso, MkfsConf::FS_CDFS );
-            HP::HFPlusOut mac; tagVolume( mac, MkfsConf::FS_HFSX );
-            VF::VFat32Out fat; tagVolume( fat, MkfsConf::FS_Fat32 );
-
-            Volume * out;
-            if( cfg.fsType & MkfsConf::FS_CDFS )
-            {
-                if( cfg.fsType & MkfsConf::FS_HFSX )
-                { iso.setHybrid( mac ); }
-                out = &iso;
-            }
-            else if( cfg.fsType & MkfsConf::FS_HFSX )
-            { out = &mac; }
-            else if( cfg.fsType & MkfsConf::FS_Fat32 )
-            {
-                out = &fat;
-                // a mild version of bestBlkSize() in fsview_temp.cpp
-                if( !cfg.isTargetMapped() && out->blockSize() < 2048u )
-                { out->setBlockSize( 2048u ); }
-            }
-            else if( !cfg.fsType )
-            { printf( "No filesystem requested\n" ); abort(); }
-            else
-            { printf( "Unsupported filesystem!\n" ); abort(); }
-
-            out->represent( tree, outImage, tmpImage );
+            std::vector<std::thread> builders;
+            for( size_t index = 0; index < shards.size(); ++index )
+            { builders.emplace_back( work, index ); }
+            for( auto & builder : builders ) { builder.join(); }
+        }
+        else { work( 0 ); }
 
+        if( cfg.plan_only )
+        {
+            // the peak memory footprint of the whole build, all shards together
+            struct rusage usage;
+            getrusage( RUSAGE_SELF, &usage );
+            printf( "plan.peak.rss=%ld\n", usage.ru_maxrss * 1024L );
+        }
+        else if( cfg.target )
+        {
             for( std::pair<const char *, const char *> & props : cfg.setOnDone )
             {
                 __system_property_set( props.first, props.second );
@@ -6,6 +6,7 @@
 
 #include "conf/config.h"
 
+#include "impl/simd.h"
 #include "impl/unique.h"
 #include "impl/vfat32.h"
 
@@ -34,6 +35,7 @@ int main( int argc, char ** argv )
 {
     TempConf cfg;
     cfg.parse( argc, argv );
+    if( cfg.isa && !Simd::Select( cfg.isa ) ) { printf( "Unsupported instruction set: %s\n", cfg.isa ); abort(); }
 
     // create a writable FAT32 partition of desired size
     Ptr<Burner> outImage = New<FileBurner>( cfg.target );
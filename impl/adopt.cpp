@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "adopt.h"
+
+#include <atomic>
+
+namespace
+{
+
+/// Copy a file range at fixed offsets, so that concurrent copies to the same
+/// storage don't contend for its file position. copy_file_range() lets the
+/// kernel skip the user space; it's refused across filesystems and to block
+/// devices on most kernels, and then the data take a pread/pwrite detour.
+bool CopyRange( int inFd, off64_t from, int outFd, off64_t to, off64_t length )
+{
+    static std::atomic<bool> kernelCopy( true );
+    while( length > 0 && kernelCopy )
+    {
+        loff_t inOff = from, outOff = to;
+        ssize_t done = syscall( __NR_copy_file_range, inFd, &inOff, outFd, &outOff, ( size_t ) length, 0u );
+        if( done < 0 )
+        {
+            if( errno == EINTR ) { continue; }
+            if( errno == ENOSYS ) { kernelCopy = false; }
+            break;
+        }
+        if( !done ) { return true; } // EOF: the tail of the last block
+        from += done; to += done; length -= done;
+    }
+
+    constexpr const size_t kChunk = 1 << 20;
+    std::vector<char> chunk( std::min<off64_t>( length, kChunk ) );
+    while( length > 0 )
+    {
+        ssize_t got = pread64( inFd, chunk.data(), std::min<off64_t>( length, chunk.size() ), from );
+        if( got < 0 && errno == EINTR ) { continue; }
+        if( got < 0 ) { perror( "pread" ); return false; }
+        if( !got ) { return true; }
+        if( pwrite64( outFd, chunk.data(), got, to ) != got ) { perror( "pwrite" ); return false; }
+        from += got; to += got; length -= got;
+    }
+    return true;
+}
+
+}
+
+Adopter::Adopter( Ptr<Burner> storage, off64_t budget, unsigned workers )
+    : _storage( storage )
+    , _budget( budget )
+    , _eager( std::min<off64_t>( budget >> 6, 1 << 20 ) )
+    , _workers( workers )
+{
+    _storage->reserve( _budget ); // a ZRam device is sized once, before any copy
+}
+
+Extent Adopter::adopt( const Extent & logical )
+{
+    blksize_t grain = std::max( _storage->blockSize(), logical.medium->blockSize() );
+
+    std::lock_guard<std::mutex> lock( _guard );
+    off64_t placed = Blocks::roundUp( _used, grain );
+    off64_t length = Blocks::roundUp( logical.length, grain );
+    if( placed + length > _budget )
+    {
+        _records.push_back( { logical, -1, false } );
+        return Extent( 0, logical.length, New<ZeroMedium>() );
+    }
+
+    _used = placed + length;
+    _queue.insert( std::make_pair( logical.length, _records.size() ) );
+    _records.push_back( { logical, placed, false } );
+    _workers.post( [this]() { copy(); } );
+    return Extent( placed, logical.length, _storage );
+}
+
+void Adopter::copy()
+{
+    Extent logical;
+    off64_t placed;
+    size_t index;
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        if( _queue.empty() ) { return; }
+        index = _queue.begin()->second;
+        _queue.erase( _queue.begin() );
+        logical = _records[index].logical;
+        placed = _records[index].placed;
+    }
+
+    if( !CopyRange( logical.medium->fd(), logical.offset, _storage->fd(), placed, logical.length ) )
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        _records[index].failed = true;
+    }
+}
+
+void Adopter::drain()
+{
+    _workers.drain();
+
+    std::lock_guard<std::mutex> lock( _guard );
+    if( _records.empty() ) { return; }
+
+    // the copies are mapped straight from the device: get them past its page cache
+    _storage->commit();
+
+    size_t adopted = 0, zeroed = 0, failed = 0;
+    off64_t adoptedSz = 0, zeroedSz = 0;
+    for( auto & record : _records )
+    {
+        const char * path = record.logical.medium->path();
+        if( record.failed )
+        {
+            ++failed;
+            fprintf( stderr, "*** Failed to adopt %s %lx+%lx\n", path ? path : "?",
+                     record.logical.offset, record.logical.length );
+        }
+        else if( record.placed >= 0 )
+        {
+            ++adopted; adoptedSz += record.logical.length;
+            printf( "Adopted %s %lx+%lx at %lx\n", path ? path : "?",
+                    record.logical.offset, record.logical.length, record.placed );
+        }
+        else
+        {
+            ++zeroed; zeroedSz += record.logical.length;
+            fprintf( stderr, "*** Zeroed %s %lx+%lx (adoption budget exceeded)\n", path ? path : "?",
+                     record.logical.offset, record.logical.length );
+        }
+    }
+    printf( "Adoption: %lu extents (%ld bytes) adopted, %lu extents (%ld bytes) zeroed; %ld of %ld bytes used\n",
+            adopted, adoptedSz, zeroed, zeroedSz, _used, _budget );
+    _records.clear();
+    // the extents of the failed copies are already handed out, and map blocks never written
+    if( failed ) { printf( "Adoption failed for %lu extents\n", failed ); abort(); }
+}
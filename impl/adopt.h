@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef ADOPT_H
+#define ADOPT_H
+
+#include "wrapper.h"
+
+#include "impl/burner.h"
+#include "impl/worker.h"
+
+/// The adoption engine ("foster house"). File extents that can't be exposed
+/// in place (encrypted, encoded, inline or never allocated) are copied to a
+/// temporary medium of a limited size (the budget) by a pool of workers while
+/// the scan goes on. Extents not fitting the budget are exposed as zeros.
+///
+/// The temporary medium must be a ZRam device if the target is mapped; the
+/// copies are then exposed with dm-linear like the files in place.
+struct Adopter
+{
+    /// Adopt up to budget bytes into the storage, using the provided number
+    /// of copy threads (zero: one per CPU core).
+    Adopter( Ptr<Burner> storage, off64_t budget, unsigned workers = 0 );
+
+    /// Extents up to this length are adopted as soon as they are found;
+    /// larger ones should be collected and adopted later, smallest first,
+    /// so that the budget is shared by as many files as possible.
+    off64_t eagerLimit() const { return _eager; }
+
+    /// Reserve the space for a logical file extent and queue its copy.
+    /// Return the Extent of the storage exposing the copy (as long as the
+    /// logical extent, within the block-aligned reservation), or a zero Extent
+    /// if the budget is exhausted.
+    Extent adopt( const Extent & logical );
+
+    /// Wait for the queued copies to complete, sync the storage and report
+    /// the adopted and zeroed extents since the last report. A failed copy
+    /// is fatal: its extent has been handed out already.
+    void drain();
+
+private:
+    /// A worker job: copy the smallest queued extent.
+    void copy();
+
+    struct Record
+    {
+        Extent logical;
+        off64_t placed; ///< the offset of the copy; negative if zeroed
+        bool failed;    ///< the copy was attempted and failed
+    };
+
+    Ptr<Burner> _storage;
+    off64_t _budget;
+    off64_t _eager;
+    off64_t _used = 0;
+
+    std::mutex _guard;
+    std::vector<Record> _records;
+    std::multimap<off64_t, size_t> _queue; ///< (length, record) pairs to copy
+
+    Workers _workers; // last: joined before the members above go away
+};
+
+#endif // ADOPT_H
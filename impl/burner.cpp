@@ -7,6 +7,10 @@
 #include "burner.h"
 
 #include "impl/attrib.h"
+#include "impl/device.h"
+#include "impl/spill.h"
+#include "impl/uring.h"
+#include "impl/worker.h"
 
 #include <sstream>
 
@@ -20,9 +24,22 @@ off64_t Planner::append( const Extent & extent )
     return cur;
 }
 
-void Planner::commit()
+void Planner::reserve()
 {
+    if( _reserved ) { return; }
     _burner->reserve( offset() );
+    _reserved = true;
+}
+
+void Planner::commit()
+{
+    reserve();
+    if( _burner->exposesGaps() ) { fillGaps(); }
+    unsigned jobs = _jobs ? _jobs : std::max( 1u, std::thread::hardware_concurrency() );
+    // a mapped Burner has no system calls to batch
+    if( _uring && _burner->isPositional() && !_burner->data() && commitUring( jobs ) ) { return; }
+    if( _burner->isPositional() ) { commitParallel( jobs ); return; }
+
     off64_t trackOff = 0;
     for( auto & extent : _extlist )
     {
@@ -42,6 +59,121 @@ void Planner::commit()
     _burner->commit();
 }
 
+void Planner::fillGaps()
+{
+    // no bits set: zeros, rendered chunk by chunk rather than held in memory
+    Ptr<Medium> zeros = New<BitsMedium>( 1 << 20 );
+    for( auto & extent : _extlist )
+    {
+        if( extent.length && ( !extent.medium || dynamic_cast<const ZeroMedium *>( extent.medium.get() ) ) )
+        { extent = Extent( 0, extent.length, zeros ); }
+    }
+}
+
+void Planner::commitParallel( unsigned jobs )
+{
+    // every extent's final offset is known: precompute them and cut the list
+    // into chunks of roughly equal byte counts, a few per thread
+    off64_t base = _burner->offset();
+    off64_t total = 0;
+    std::vector<std::pair<const Extent *, off64_t>> placed;
+    placed.reserve( _extlist.size() );
+    for( auto & extent : _extlist )
+    {
+        placed.emplace_back( &extent, base + total );
+        total += extent.length;
+    }
+    _burner->extend( base + total );
+
+    if( jobs <= 1 )
+    {
+        // on a single worker, so that generated extents (see RuleMedium) render inline too
+        Workers serial( 1 );
+        if( placed.size() ) { serial.post( [&]() { writeRun( placed, 0, placed.size() - 1 ); } ); }
+        serial.drain();
+        _extlist.clear();
+        _burner->commit();
+        return;
+    }
+
+    Workers workers( jobs );
+    off64_t quota = std::max<off64_t>( total / ( jobs * 4 ) + 1, 1 << 20 );
+    size_t first = 0;
+    off64_t bytes = 0;
+    for( size_t next = 0; next < placed.size(); ++next )
+    {
+        bytes += placed[next].first->length;
+        if( bytes < quota && next + 1 < placed.size() ) { continue; }
+        workers.post( [this, &placed, first, next]() { writeRun( placed, first, next ); } );
+        first = next + 1;
+        bytes = 0;
+    }
+    workers.drain();
+
+    _extlist.clear();
+    _burner->commit();
+}
+
+bool Planner::commitUring( unsigned jobs )
+{
+    Workers copiers( jobs );
+    UringWriter writer( _burner->fd(), copiers );
+    if( !writer.isValid() )
+    {
+        printf( "io_uring unavailable, writing with %u threads\n", jobs );
+        _uring = false;
+        return false;
+    }
+
+    off64_t base = _burner->offset();
+    off64_t at = base;
+    for( auto & extent : _extlist ) { at += extent.length; }
+    _burner->extend( at );
+
+    at = base;
+    for( auto & extent : _extlist )
+    {
+        writer.put( extent, at );
+        at += extent.length;
+    }
+    writer.finish();
+
+    _extlist.clear();
+    _burner->commit();
+    return true;
+}
+
+void Planner::writeRun( const std::vector<std::pair<const Extent *, off64_t>> & placed, size_t first, size_t last )
+{
+    // metadata come as many tiny memory extents (directory records, names, tree
+    // nodes...): gather the consecutive ones into one pwritev() each
+    std::vector<struct iovec> gather;
+    off64_t gatherAt = 0;
+    auto flush = [&]()
+    {
+        if( gather.size() ) { _burner->writeAt( gather.data(), gather.size(), gatherAt ); }
+        gather.clear();
+    };
+
+    for( size_t index = first; index <= last; ++index )
+    {
+        const Extent & extent = *placed[index].first;
+        off64_t at = placed[index].second;
+        const Medium * medium = extent.medium.get();
+        if( !extent.length ) { continue; }
+        if( medium && medium->data() )
+        {
+            if( gather.size() >= IOV_MAX ) { flush(); }
+            if( gather.empty() ) { gatherAt = at; }
+            gather.push_back( { ( char * ) medium->data() + extent.offset, ( size_t ) extent.length } );
+            continue;
+        }
+        flush();
+        _burner->writeAt( extent, at );
+    }
+    flush();
+}
+
 blksize_t Planner::copad( Planner & outPlanner, Planner & tmpPlanner )
 {
     blksize_t commonBlock = std::max( outPlanner.blockSize(),
@@ -51,6 +183,129 @@ blksize_t Planner::copad( Planner & outPlanner, Planner & tmpPlanner )
     return commonBlock;
 }
 
+namespace
+{
+
+/// A run of identical bytes of the temporary medium.
+struct Constant
+{
+    off64_t offset;
+    off64_t length;
+    uint8_t value;
+};
+
+/// Split [pos, end) at the boundaries of the sorted runs, calling emit( from, till, run )
+/// for every piece; the run is null outside of the runs.
+template <typename Emit>
+void Carve( const std::vector<Constant> & runs, off64_t pos, off64_t end, Emit emit )
+{
+    auto itr = std::upper_bound( runs.begin(), runs.end(), pos, []( off64_t at, const Constant & run )
+    {
+        return at < run.offset + run.length;
+    } );
+    for( ; pos < end; ++itr )
+    {
+        off64_t from = itr == runs.end() ? end : std::max( std::min( itr->offset, end ), pos );
+        if( from > pos ) { emit( pos, from, nullptr ); pos = from; }
+        if( pos == end ) { break; }
+        off64_t till = std::min( itr->offset + itr->length, end );
+        emit( pos, till, &*itr );
+        pos = till;
+    }
+}
+
+}
+
+off64_t Planner::dedup( Planner & outPlanner, Planner & tmpPlanner, size_t maxTargets )
+{
+    // 1. the runs of identical bytes of the temporary medium, coalesced
+    blksize_t unit = std::max( outPlanner.blockSize(), tmpPlanner.blockSize() );
+    std::vector<Constant> runs;
+    auto add = [&runs]( off64_t offset, off64_t length, uint8_t value )
+    {
+        if( runs.size() && runs.back().offset + runs.back().length == offset && runs.back().value == value )
+        { runs.back().length += length; }
+        else { runs.push_back( { offset, length, value } ); }
+    };
+    off64_t at = 0;
+    for( const Extent & extent : tmpPlanner._extlist )
+    {
+        const RuleMedium * rule = dynamic_cast<const RuleMedium *>( extent.medium.get() );
+        if( !extent.medium ) { add( at, extent.length, 0 ); }
+        else if( rule )
+        {
+            for( off64_t done = 0; done < extent.length; )
+            {
+                uint8_t value;
+                off64_t length = rule->uniform( Range( { extent.offset + done, extent.length - done } ), value );
+                if( length ) { add( at + done, length, value ); done += length; }
+                else { done = roundUp( at + done + 1, unit ) - at; } // no run to start in this block
+            }
+        }
+        at += extent.length;
+    }
+
+    // ...trimmed to whole blocks
+    off64_t spared = 0;
+    size_t kept = 0;
+    for( const Constant & run : runs )
+    {
+        off64_t from = roundUp( run.offset, unit );
+        off64_t till = ( run.offset + run.length ) & ~( off64_t )( unit - 1 );
+        if( from < till ) { runs[kept++] = { from, till - from, run.value }; spared += till - from; }
+    }
+    runs.resize( kept );
+    if( runs.empty() ) { return 0; }
+
+    // 2. the output extents of the temporary medium, remapped (the shared blocks go last)
+    constexpr const off64_t kSharedSz = 1 << 20;
+    off64_t sharedSz = roundUp( kSharedSz, unit );
+    off64_t sharedAt = roundUp( tmpPlanner.offset(), unit );
+    std::vector<uint8_t> shared;
+    const Medium * tmp = tmpPlanner._burner.get();
+    ExtentList remap;
+    for( const Extent & extent : outPlanner._extlist )
+    {
+        if( extent.medium.get() != tmp ) { remap.push_back( extent ); continue; }
+        Carve( runs, extent.offset, extent.offset + extent.length, [&]( off64_t from, off64_t till, const Constant * run )
+        {
+            if( !run ) { remap.emplace_back( from, till - from, extent.medium ); return; }
+            if( !run->value ) { remap.push_back( ZeroExtent( till - from ) ); return; }
+            size_t index = std::find( shared.begin(), shared.end(), run->value ) - shared.begin();
+            if( index == shared.size() ) { shared.push_back( run->value ); }
+            for( off64_t part = from; part < till; part += sharedSz )
+            { remap.emplace_back( sharedAt + index * sharedSz, std::min( sharedSz, till - part ), extent.medium ); }
+        } );
+    }
+
+    size_t extra = remap.size() - outPlanner._extlist.size();
+    if( extra > maxTargets )
+    {
+        printf( "Deduplication skipped: %lu extra targets over %lu\n", extra, maxTargets );
+        return 0;
+    }
+    outPlanner._extlist.swap( remap );
+
+    // 3. the runs of the temporary medium left unwritten
+    ExtentList carved;
+    at = 0;
+    for( const Extent & extent : tmpPlanner._extlist )
+    {
+        Carve( runs, at, at + extent.length, [&]( off64_t from, off64_t till, const Constant * run )
+        {
+            if( run || !extent.medium ) { carved.push_back( ZeroExtent( till - from ) ); }
+            else { carved.emplace_back( extent.offset + ( from - at ), till - from, extent.medium ); }
+        } );
+        at += extent.length;
+    }
+    tmpPlanner._extlist.swap( carved );
+    tmpPlanner.padTo( unit );
+    for( uint8_t value : shared ) { tmpPlanner.append( VectExtent<std::string>( std::string( sharedSz, value ) ) ); }
+
+    printf( "Deduplicated %lx bytes of the temporary medium into %lu extra targets\n", spared, extra );
+    return spared;
+}
+
 off64_t VectBurner::append( const Extent & extent )
 {
     off64_t cur = offset();
@@ -63,23 +318,169 @@ off64_t VectBurner::append( const Extent & extent )
     return cur;
 }
 
-FileBurner::FileBurner( int fd, bool autoclose ) : _out_fd( fd ), _aclose( autoclose && isValid() ) {}
+off64_t CountBurner::append( const Extent & extent )
+{
+    off64_t cur = offset();
+    ++_extents;
+    if( extent.medium ) { _written += extent.length; }
+    else { ++_holes; }
+    _offset += extent.length;
+    return cur;
+}
+
+FileBurner::FileBurner( int fd, bool autoclose ) : _out_fd( fd ), _aclose( autoclose && isValid() )
+{ if( isValid() ) { _offset = lseek64( _out_fd, 0, SEEK_CUR ); } }
 
 FileBurner::FileBurner( const char * path ) : FileBurner( open( path, O_RDWR | O_CREAT | O_TRUNC, CREAT_MODE ), true )
 { if( _out_fd < 0 ) { perror( path ); abort(); } }
 
 FileBurner::~FileBurner() { if( _aclose ) { close( _out_fd ); } }
 
-off64_t FileBurner::offset() const { return lseek( _out_fd, 0, SEEK_CUR ); }
-
 off64_t FileBurner::append( const Extent & extent )
 {
     auto placement = offset();
     if( extent.length ) { extent.writeToFd( _out_fd ); }
+    _offset += extent.length;
     return placement;
 }
 
-TempBurner::TempBurner( blksize_t blkSz ) : FileBurner( memfd_open( "tempfd", O_RDWR ), true ), _blk_sz( blkSz ) {}
+void FileBurner::writeAt( const struct iovec * iov, int count, off64_t at )
+{
+    std::vector<struct iovec> rest( iov, iov + count );
+    struct iovec * next = rest.data();
+    while( count )
+    {
+        ssize_t written = pwrite_vector( _out_fd, next, count, at );
+        if( written < 0 && errno == EINTR ) { continue; }
+        if( written <= 0 ) { perror( "pwritev" ); abort(); }
+        at += written;
+        // skip the complete buffers and trim the partial one
+        while( count && ( size_t ) written >= next->iov_len ) { written -= next->iov_len; ++next; --count; }
+        if( count ) { next->iov_base = ( char * ) next->iov_base + written; next->iov_len -= written; }
+    }
+}
+
+void FileBurner::extend( off64_t end )
+{
+    // a regular file grows once, instead of on every concurrent write;
+    // ftruncate() keeps the gaps sparse and the clones possible
+    struct stat64 st;
+    if( fstat64( _out_fd, &st ) >= 0 && S_ISREG( st.st_mode ) && st.st_size < end
+        && ftruncate64( _out_fd, end ) < 0 ) { perror( "ftruncate" ); abort(); }
+    lseek64( _out_fd, end, SEEK_SET );
+    _offset = end;
+}
+
+Ptr<Burner> Burner::stage( off64_t /*at*/, blksize_t blkSz )
+{
+    return Spill::Over() ? Spill::Stage( blkSz ) : New<VectBurner>( blkSz );
+}
+
+namespace
+{
+
+/// A window of a TempBurner mapping starting at a fixed offset; appending to it
+/// composes the contents of an extent exactly where it is going to be committed.
+class StageBurner : public Burner
+{
+public:
+    /// The host outlives the stage: the staged extent is planned on the host.
+    StageBurner( TempBurner & host, off64_t at, blksize_t blkSz ) : _host( host ), _at( at ), _blk_sz( blkSz ) {}
+    blksize_t blockSize() const override { return _blk_sz; }
+    bool isValid() const override { return true; }
+    off64_t offset() const override { return _length; }
+    const void * data() const override { return ( const char * ) _host.data() + _at; }
+    void reserve( off64_t size ) override { _host.grow( _at + size ); }
+
+    off64_t append( const Extent & extent ) override
+    {
+        off64_t cur = _length;
+        _host.grow( _at + cur + extent.length );
+        char * out = ( char * ) data() + cur;
+        if( extent.medium && extent.medium->data() )
+        { memcpy( out, ( const char * ) extent.medium->data() + extent.offset, extent.length ); }
+        else if( extent.medium ) { extent.writeToFd( _host.fd(), _at + cur ); }
+        else { memset( out, 0, extent.length ); }
+        _length += extent.length;
+        return cur;
+    }
+
+private:
+    TempBurner & _host;
+    off64_t _at;
+    off64_t _length = 0;
+    blksize_t _blk_sz;
+};
+
+}
+
+TempBurner::TempBurner( blksize_t blkSz ) : TempBurner( memfd_open( "tempfd", O_RDWR ), blkSz ) {}
+
+TempBurner::TempBurner( int fd, blksize_t blkSz ) : FileBurner( fd, true ), _blk_sz( blkSz )
+{
+    if( !isValid() ) { perror( "memfd" ); abort(); }
+    // address space is cheap, remapping is not: start big enough for most trees
+    _span = sizeof( void * ) > 4 ? ( 1LL << 32 ) : ( 64LL << 20 );
+    void * base = mmap( nullptr, _span, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, _out_fd, 0 );
+    if( base == MAP_FAILED ) { perror( "mmap(memfd)" ); abort(); }
+    _base = ( char * ) base;
+}
+
+TempBurner::~TempBurner() { if( _base ) { munmap( _base, _span ); } }
+
+void TempBurner::grow( off64_t end )
+{
+    if( end <= _size ) { return; }
+    // sparse growth costs nothing, so grow geometrically
+    off64_t size = std::max( end, std::max<off64_t>( _size * 2, 1 << 20 ) );
+    if( size > _span )
+    {
+        off64_t span = _span;
+        while( span < size ) { span *= 2; }
+        void * base = mremap( _base, _span, span, MREMAP_MAYMOVE );
+        if( base == MAP_FAILED ) { perror( "mremap(memfd)" ); abort(); }
+        _base = ( char * ) base;
+        _span = span;
+    }
+    if( ftruncate64( _out_fd, size ) < 0 ) { perror( "ftruncate(memfd)" ); abort(); }
+    _size = size;
+}
+
+off64_t TempBurner::append( const Extent & extent )
+{
+    off64_t cur = _offset;
+    grow( cur + extent.length );
+    writeAt( extent, cur );
+    _offset += extent.length;
+    return cur;
+}
+
+void TempBurner::writeAt( const Extent & extent, off64_t at )
+{
+    const char * from = extent.medium ? ( const char * ) extent.medium->data() : nullptr;
+    if( !from ) { if( extent.medium ) { extent.writeToFd( _out_fd, at ); } return; } // the file grows zeroed
+    from += extent.offset;
+    if( from == _base + at ) { return; } // staged in place
+    if( from >= _base && from < _base + _size ) { printf( "Staged extent misplaced: %lx vs %lx\n", from - _base, at ); abort(); }
+    memcpy( _base + at, from, extent.length );
+}
+
+void TempBurner::writeAt( const struct iovec * iov, int count, off64_t at )
+{
+    for( int index = 0; index < count; ++index )
+    {
+        if( iov[index].iov_base != _base + at ) { memcpy( _base + at, iov[index].iov_base, iov[index].iov_len ); }
+        at += iov[index].iov_len;
+    }
+}
+
+void TempBurner::extend( off64_t end )
+{
+    grow( end );
+    _offset = end;
+}
+
+Ptr<Burner> TempBurner::stage( off64_t at, blksize_t blkSz ) { return New<StageBurner>( *this, at, blkSz ); }
 
 ZRAMBurner::ZRAMBurner( const char * device, const char * sysFs )
     : FileBurner( open( device, O_RDWR ) )
@@ -110,6 +511,7 @@ void ZRAMBurner::reserve( off64_t size )
     // MOREINFO make fd() lazy instead? really?
     _out_fd = open( _dev_node.c_str(), O_RDWR );
     if( _out_fd < 0 ) { perror( "reopen" ); abort(); }
+    _offset = 0;
 }
 
 void ZRAMBurner::setAttr( const char * attr, const char * value )
@@ -117,6 +519,71 @@ void ZRAMBurner::setAttr( const char * attr, const char * value )
     setAttrib( dirfd( _sys_fs_control ), attr, value );
 }
 
+PinnedBurner::PinnedBurner( const char * path, Ptr<ExtentIoc> locator )
+    : FileBurner( open( path, O_RDWR | O_CREAT, CREAT_MODE ), true ) // truncated on reserve()
+    , _path( path )
+    , _locator( locator )
+{
+    if( !isValid() || fstat64( fd(), &_st ) < 0 ) { perror( path ); abort(); }
+    if( !_locator ) { printf( "No locator for %s\n", path ); abort(); }
+}
+
+void PinnedBurner::reserve( off64_t size )
+{
+    // the target mapping the previous contents is torn down by now (see DiskBurner)
+    size = roundUp( size );
+    if( ftruncate64( fd(), 0 ) < 0 ) { perror( _path.c_str() ); abort(); }
+    __u32 pin = 1; // F2FS pins empty files only
+    if( ioctl( fd(), F2FS_IOC_SET_PIN_FILE, &pin ) < 0 && errno != ENOTTY && errno != EOPNOTSUPP )
+    { perror( "F2FS_IOC_SET_PIN_FILE" ); }
+    if( fallocate64( fd(), 0, 0, size ) < 0 ) { perror( _path.c_str() ); abort(); }
+    _offset = 0;
+    _located.clear();
+}
+
+void PinnedBurner::commit()
+{
+    // the planned gaps are written by now (see exposesGaps()); the preallocated
+    // tail past them is zeroed for real, as it may share a block with the last extent
+    static const std::vector<char> zeros( 1 << 20 );
+    off64_t size = lseek64( fd(), 0, SEEK_END );
+    for( off64_t tail = offset(), part; tail < size; tail += part )
+    {
+        part = pwrite64( fd(), zeros.data(), std::min<off64_t>( zeros.size(), size - tail ), tail );
+        if( part <= 0 && errno != EINTR ) { perror( _path.c_str() ); abort(); }
+        part = std::max<off64_t>( part, 0 );
+    }
+    if( fsync( fd() ) < 0 ) { perror( _path.c_str() ); abort(); }
+}
+
+ExtentList PinnedBurner::locate( const Range & range ) const
+{
+    if( _located.empty() )
+    {
+        // written and synced by now (see Volume::represent()): no extent is pending
+        Ptr<FileMedium> self = New<FileMedium>( fd() );
+        _located = _locator->inPlace( Extent( 0, self->_st.st_size, self ) );
+        off64_t total = 0;
+        for( const Extent & extent : _located )
+        {
+            if( !extent.medium || !extent.medium->isDirectDevice() )
+            { printf( "%s can't be mapped in place (encrypted?)\n", _path.c_str() ); abort(); }
+            total += extent.length;
+        }
+        if( total < self->_st.st_size ) { printf( "%s isn't fully allocated\n", _path.c_str() ); abort(); }
+    }
+
+    // the extents tile the file in order
+    ExtentList out;
+    off64_t pos = 0, end = range.offset + range.length;
+    for( auto itr = _located.begin(); itr != _located.end() && pos < end; pos += itr++->length )
+    {
+        off64_t from = std::max( range.offset, pos ), till = std::min( end, pos + itr->length );
+        if( from < till ) { out.emplace_back( itr->offset + ( from - pos ), till - from, itr->medium ); }
+    }
+    return out;
+}
+
 DiskBurner::DiskBurner( const char * name, const char * ctrlNode )
     : _ioc_comm( New<VectBurner>( sizeof( __u64 ) ) )
     , _dm_table_builder( _ioc_comm )
@@ -159,6 +626,13 @@ off64_t DiskBurner::append( const Extent & extent )
     bool mappable = extent.medium.get()
                     && extent.medium->blockDevice()
                     && extent.medium->isDirectDevice();
+    if( !mappable && extent.medium.get() )
+    {
+        // e.g. a file on a mounted partition: map the blocks holding it
+        ExtentList located = extent.medium->locate( extent );
+        for( const Extent & part : located ) { append( part ); }
+        if( located.size() ) { return cur; }
+    }
     const char * type;
     spec.next = sizeof( spec );
     std::string parm;
@@ -196,7 +670,13 @@ void DiskBurner::commit()
     if( false ) { dumpOutput( "/sdcard/dm.dmp" ); }
 
     if( ioctl( _control_fd, DM_TABLE_LOAD, _ioc_comm->data() ) < 0 ) { perror( "DM_TABLE_LOAD" ); abort(); }
+    if( !_deferred ) { publish(); }
+}
 
+void DiskBurner::publish()
+{
+    // resuming swaps the loaded (inactive) table in: the device goes live
+    _deferred = false;
     _header.data_start = 0;
     _header.data_size = sizeof( _header );
     _header.target_count = 0;
@@ -31,6 +31,39 @@ public:
 
     /// Allocate the needed space on the backing Medium.
     virtual void reserve( off64_t /*size*/ ) {}
+
+    /// Whether the extents may be written concurrently at precomputed offsets
+    /// with writeAt() instead of being appended one by one.
+    virtual bool isPositional() const { return false; }
+
+    /// Write the extent at the provided offset. Only valid if isPositional().
+    virtual void writeAt( const Extent & /*extent*/, off64_t /*at*/ ) { abort(); }
+
+    /// Write the gathered memory ranges back to back at the provided offset.
+    /// Only valid if isPositional().
+    virtual void writeAt( const struct iovec * /*iov*/, int /*count*/, off64_t /*at*/ ) { abort(); }
+
+    /// Grow the medium to the provided size (if needed) and move the append
+    /// position there, as if the extents up to that point had been appended.
+    virtual void extend( off64_t /*end*/ ) { abort(); }
+    /// Return a Burner to stage the contents of an extent that will be appended
+    /// at the provided offset, e.g. a directory that has to be contiguous and
+    /// amended later. By default, the stage is a separate VectBurner whose contents
+    /// are copied on commit; a memory-mapped Burner stages them in place instead.
+    /// Over the memory budget (see Spill), the default stage is in the spill file.
+    virtual Ptr<Burner> stage( off64_t at, blksize_t blkSz );
+
+    /// Whether the ranges left unwritten (zero extents) would expose stale data,
+    /// e.g. the preallocated blocks of a file mapped in place. The Planner then
+    /// writes the zeros for real.
+    virtual bool exposesGaps() const { return false; }
+
+    /// Keep the contents away from readers on commit() until publish() is called,
+    /// e.g. load a device-mapper table but resume the device later.
+    virtual void deferPublish() {}
+
+    /// Expose the contents committed since deferPublish().
+    virtual void publish() {}
 };
 
 /// A Planner collects a series of Extents before writing them to a Burner
@@ -59,6 +92,20 @@ public:
     /// Return the Medium backed by this Planner.
     Ptr<Medium> medium() { return _burner; }
 
+    /// Return a Burner to stage the next appended extent with (see Burner::stage()).
+    /// Nothing else may be appended before the staged extent.
+    Ptr<Burner> stage( blksize_t blkSz ) { return _burner->stage( _burner->offset() + _offset, blkSz ); }
+
+    /// Set the number of threads writing to a positional Burner (zero: one per CPU core).
+    void setJobs( unsigned jobs ) { _jobs = jobs; }
+
+    /// Write to a positional Burner through io_uring, if the kernel allows.
+    void setUring( bool uring ) { _uring = uring; }
+
+    /// Allocate the space for the planned extents on the Burner, once.
+    /// Happens on commit() unless done in advance.
+    void reserve();
+
     /// Write ("burn") the stored extent sequence to the Burner provided on construction,
     virtual void commit() override;
 
@@ -77,10 +124,32 @@ public:
     /// Pad two Planner\s' current offsets to satisfy their block size requirements simultaneosly.
     static blksize_t copad( Planner & left, Planner & right );
 
+    /// Map the constant blocks of the temporary medium (padding, allocation bitmaps, free FAT
+    /// space) that the output medium maps, onto zero extents or onto one shared block per value,
+    /// and leave them unwritten. Only fit for a mapped output, where every extent is a target.
+    /// Gives up if that takes more than maxTargets extra extents; returns the bytes spared.
+    static off64_t dedup( Planner & outPlanner, Planner & tmpPlanner, size_t maxTargets );
+
 private:
+    /// Replace the zero extents with written zeros (see Burner::exposesGaps()).
+    void fillGaps();
+
+    /// Write the stored extents with a pool of threads, in byte-balanced chunks.
+    void commitParallel( unsigned jobs );
+
+    /// Write the placed extents [first, last] to a positional Burner, gathering
+    /// the consecutive memory-backed ones into single writes.
+    void writeRun( const std::vector<std::pair<const Extent *, off64_t>> & placed, size_t first, size_t last );
+
+    /// Write the stored extents through io_uring; return false if it's unavailable.
+    bool commitUring( unsigned jobs );
+
     Ptr<Burner> _burner;
     ExtentList _extlist;
     blksize_t _clientSz;
+    unsigned _jobs = 1;
+    bool _uring = false;
+    bool _reserved = false;
 
 private:
     off64_t _offset = 0;
@@ -102,6 +171,39 @@ private:
     std::vector<char> _out_vec;
 };
 
+/// A Burner that writes nothing ("blackhole"), only counting what would be written:
+/// lets a volume be laid out dry to learn the sizes of its media in advance.
+class CountBurner : public Burner
+{
+public:
+    /// Stand in for a medium of the provided block size; a block device if direct.
+    CountBurner( blksize_t blkSz, bool direct ) : _blk_sz( blkSz ), _direct( direct ) {}
+    blksize_t blockSize() const override { return _blk_sz; }
+    bool isDirectDevice() const override { return _direct; }
+    bool isValid() const override { return true; }
+    void reserve( off64_t size ) override { _reserved = std::max( _reserved, roundUp( size ) ); }
+    off64_t offset() const override { return _offset; }
+    off64_t append( const Extent & extent ) override;
+
+    /// The size reserved, rounded up to the block size (as a ZRam disksize would be).
+    off64_t reserved() const { return _reserved; }
+    /// The number of extents appended; on a mapped medium, of the mapper targets.
+    size_t extents() const { return _extents; }
+    /// The number of zero extents appended, left unwritten (or mapped to the zero target).
+    size_t holes() const { return _holes; }
+    /// The number of bytes that would actually be written.
+    off64_t written() const { return _written; }
+
+private:
+    blksize_t _blk_sz;
+    bool _direct;
+    off64_t _reserved = 0;
+    off64_t _offset = 0;
+    off64_t _written = 0;
+    size_t _extents = 0;
+    size_t _holes = 0;
+};
+
 /// A Burner backed by a file.
 class FileBurner : public Burner
 {
@@ -115,22 +217,48 @@ public:
 
     blksize_t blockSize() const override { return 1; }     // a file is similar to a character device
     bool isValid() const override { return _out_fd >= 0; }
-    off64_t offset() const override;
+    off64_t offset() const override { return _offset; }
     off64_t append( const Extent & extent ) override;
     void commit() override { fsync( _out_fd ); }
     int fd() const override { return _out_fd; }
+    bool isPositional() const override { return true; }
+    void writeAt( const Extent & extent, off64_t at ) override { extent.writeToFd( _out_fd, at ); }
+    void writeAt( const struct iovec * iov, int count, off64_t at ) override;
+    void extend( off64_t end ) override;
 
 protected:
     int _out_fd;
     bool _aclose;
+    off64_t _offset = 0; ///< the append position, tracked rather than queried with lseek()
 };
 
-/// A Burner backed by a temporary, memory-resident file ("memfd").
-struct TempBurner : public FileBurner
+/// A Burner backed by a temporary, memory-resident file ("memfd"),
+/// also mapped to memory. Memory extents are copied rather than written,
+/// and the staged ones (see stage()) are composed in place and never copied.
+class TempBurner : public FileBurner
 {
+public:
     TempBurner( blksize_t blkSz = 1 );
+    /// Construct a TempBurner over a pre-open fd of an empty file (e.g. an O_TMPFILE), assuming ownership.
+    TempBurner( int fd, blksize_t blkSz );
+    ~TempBurner();
     blksize_t blockSize() const override { return _blk_sz; }
+    const void * data() const override { return _base; }
+    off64_t append( const Extent & extent ) override;
+    void commit() override {}
+    void writeAt( const Extent & extent, off64_t at ) override;
+    void writeAt( const struct iovec * iov, int count, off64_t at ) override;
+    void extend( off64_t end ) override;
+    Ptr<Burner> stage( off64_t at, blksize_t blkSz ) override;
+
+    /// Ensure the file and the mapping cover [0, end).
+    void grow( off64_t end );
+
+private:
     blksize_t _blk_sz;
+    char * _base = nullptr;
+    off64_t _size = 0; ///< the file size
+    off64_t _span = 0; ///< the mapping size, address space only
 };
 
 /// A Burner backed by a ZRam (compressible RAM) virtual drive.
@@ -161,6 +289,32 @@ private:
     blksize_t _blks;
 };
 
+struct ExtentIoc;
+
+/// A Burner backed by a preallocated regular file that a mapped target maps in place:
+/// a temporary medium that costs no RAM, unlike a ZRam device. The file is pinned
+/// (on F2FS, against garbage collection) and allocated on reserve(); once written
+/// and synced, its blocks are resolved with the provided locator (FIEMAP), which
+/// must not adopt: an encrypted or inlined file can't be used.
+/// The file must stay in place, and be unencrypted, while the target is exposed.
+class PinnedBurner : public FileBurner
+{
+public:
+    PinnedBurner( const char * path, Ptr<ExtentIoc> locator );
+    blksize_t blockSize() const override { return _st.st_blksize; }
+    dev_t blockDevice() const override { return _st.st_dev; }
+    void reserve( off64_t size ) override;
+    bool exposesGaps() const override { return true; } // F2FS reports preallocated blocks as data
+    void commit() override;
+    ExtentList locate( const Range & range ) const override;
+
+private:
+    std::string _path;
+    Ptr<ExtentIoc> _locator;
+    struct stat64 _st;
+    mutable ExtentList _located; ///< the blocks of the whole file, resolved on first use
+};
+
 /// A Burner backed by the disk mapper kernel module.
 /// https://www.kernel.org/doc/Documentation/device-mapper/
 /// Builds the actual virtual disks exposed to the user machine.
@@ -174,6 +328,8 @@ public:
     off64_t offset() const override { return _offset; }
     off64_t append( const Extent & extent ) override;
     void commit() override;
+    void deferPublish() override { _deferred = true; }
+    void publish() override;
     dev_t blockDevice() const override { return _dev; }
 
     ~DiskBurner() { if( isValid() ) { close( _control_fd ); } }
@@ -190,6 +346,7 @@ private://data
     struct dm_ioctl _header;
     dev_t _dev = 0; // defined after commit()
     off64_t _offset = 0;
+    bool _deferred = false; ///< the table is loaded on commit(), resumed on publish()
 };
 
 #endif // BURNER_H
@@ -110,8 +110,7 @@ Colonies CD9660Out::plan( const Original & tree, Planner & outPlanner, Planner &
     off64_t tmpToOut = outPlanner.offset() - innerOff;
     planVolumes( outPlanner, [&]( CD9660Out::FS & vol )
     {
-        StdRand shuf;
-        std::map<PathEntry *, std::list<Later::Use>> parents;
+        BackLinks<DirectoryEntry> parents;
         struct FolDef
         {
             Extent extent;
@@ -119,16 +118,25 @@ Colonies CD9660Out::plan( const Original & tree, Planner & outPlanner, Planner &
             std::string encName;
         };
         std::map<Entry *, FolDef> fsFolders;
+        // created up front: the drafts of the parents fill in the names concurrently
+        for( PathEntry * pDir : tree.pathTable ) { fsFolders[pDir]; }
         const blksize_t blkSz = vol.vol->blkSz;
+        const off64_t maxRun = ( 1LL << 32 ) - blkSz; // the largest whole-block 32-bit extent length
 
-        DirectoryEntry & dot = vol.vol->rootDirectory;
-        // we will reuse the field along the way; but the last one will be root!
-        for( auto itr = tree.pathTable.rbegin(); itr != tree.pathTable.rend(); ++itr )
+        /// The records of a folder, and the offsets of the entries of its subfolders.
+        struct Draft
         {
-            PathEntry * pDir = *itr;
-            auto dirOffset = tmpPlanner.offset() + tmpToOut;
-            // we can replace the ctor with a factory method - just hide Later::Store() behind the facade method
-            Ptr<Burner> dirBurner = New<VectBurner>( blkSz ); // New<TempBurner>(blkSz)
+            Ptr<Burner> records;
+            std::vector<std::pair<off64_t, Entry *>> subs;
+        };
+        // NOTE - first two entries are this (current) folder and the parent ..folder
+        constexpr const off64_t ownOffset = 0, parentOffset = sizeof( DirectoryEntry );
+
+        // the root directory entry is the model of all the '.' and '..' entries; the last one is root!
+        const DirectoryEntry model = vol.vol->rootDirectory;
+        auto encode = [&]( PathEntry * pDir, Draft & draft )
+        {
+            Ptr<Burner> dirBurner = draft.records = New<VectBurner>( blkSz );
             dirBurner->reserve( blkSz );
             auto writeEntry = [dirBurner, blkSz]( const DirectoryEntry & die, const std::string & enc )
             {
@@ -140,36 +148,25 @@ Colonies CD9660Out::plan( const Original & tree, Planner & outPlanner, Planner &
                 return cur;
             };
             // for each folder, sort entries by names, write directories and file extents
-            // NOTE - first two entries are this (current) folder and the parent ..folder
+            DirectoryEntry dot = model;
             dot.dateTime = pDir->stat.st_mtim;
             dot.fileFlags |= XAttrFlags::Folder;
-            dot.extentLba = dirOffset / blkSz;
             dot.fileName.data[0] = 0;
-            // specialEntry.length will be written later
-            off64_t ownOffset = dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
-            Later::Use ownSize = Later::Store<decltype( dot.length )>( DtOf( dirBurner ),
-                                                                       ownOffset + offsetof( DirectoryEntry, length ), dot.length,
-                                                                       []( decltype( dot.length )& lfield, const Range & range )
-            {
-                lfield = range.length;
-            } ); // for length
+            // the LBA and length will be written on placement
+            dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
             dot.fileName.data[0] = 1;
-            off64_t parentOffset = dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
-            PathEntry * parent = pDir->parent ? pDir->parent : pDir;
-            parents[parent].push_back( Later::Store<DirectoryEntry>( DtOf( dirBurner ),
-                                                                     parentOffset, dot,
-                                                                     [parent, blkSz]( DirectoryEntry & lfield, const Range & range )
-            {
-                lfield.dateTime = parent->stat.st_mtim;
-                lfield.extentLba = range.offset / blkSz; // as above, tmpPlanner.offset() + tmpToOut
-                lfield.length = range.length;
-            } ) ); // for length
+            dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
 
+            CrcVariant shuf;
             NamePool pool; // temporary, while a folder is being read
+            std::vector<Entry *> sources; // fitted in the name order, not the traversal order
+            for( Ptr<Entry> pEnt : pDir->entries ) { sources.push_back( pEnt.get() ); }
+            std::sort( sources.begin(), sources.end(), []( const Entry * left, const Entry * right )
+            { return left->decoded < right->decoded; } );
             std::map<Unicomp, Entry *> entries; // names are unique at this point
-            for( Ptr<Entry> pEnt : pDir->entries )
+            for( Entry * pEnt : sources )
             {
-                entries[pool.fitName( pEnt->decoded, pEnt->isFile(), *vol.rule, shuf )] = pEnt.get();
+                entries[pool.fitName( pEnt->decoded, pEnt->isFile(), *vol.rule, shuf )] = pEnt;
             }
             for( auto & nEnt : entries )
             {
@@ -188,50 +185,74 @@ Colonies CD9660Out::plan( const Original & tree, Planner & outPlanner, Planner &
                 {
                     // Principal components: FLAG, LBA, LENGTH
                     off64_t length = pEnt->stat.st_size;
-                    for( const Extent & xt : tree.layout.at( pEnt ) )
+                    // the runs are in target dev coordinates, and each fits the 32-bit length
+                    for( const Range & run : srcToTrg.translate( tree.layout.at( pEnt ), maxRun ) )
                     {
-                        // the offset here is in source dev coordinates; adjust...
-                        off64_t offset = srcToTrg.withinDisk( xt );
-                        // the offset here is in target dev coordinates
-                        die.extentLba = offset / blkSz;
-                        if( length <= xt.length )
+                        die.extentLba = run.offset / blkSz;
+                        if( length <= run.length )
                         { die.fileFlags &= ~XAttrFlags::TBCont; }
                         else
                         { die.fileFlags |= XAttrFlags::TBCont; }
-                        die.length = std::min( length, xt.length );
-                        length -= xt.length;
+                        die.length = std::min( length, run.length );
+                        length -= run.length;
                         writeEntry( die, encName );
                     }
                 }
                 else
                 {
-                    // Principal components: FLAG, LBA, LENGTH
-                    const Extent & xt = fsFolders[pEnt].extent;
+                    // Principal component: FLAG; the LBA and length will be written on placement
                     die.fileFlags |= XAttrFlags::Folder;
-                    // the offset is in target dev coordinates
-                    die.extentLba = xt.offset / blkSz;
-                    die.length = xt.length;
-                    writeEntry( die, encName );
+                    draft.subs.emplace_back( writeEntry( die, encName ), pEnt );
                     // put folder name for path table
-                    fsFolders[pEnt].conv = name.conv;
-                    fsFolders[pEnt].encName = encName;
+                    FolDef & subData = fsFolders.at( pEnt );
+                    subData.conv = name.conv;
+                    subData.encName = encName;
                 }
             }
+        };
+        auto place = [&]( PathEntry * pDir, Draft & draft )
+        {
+            auto dirOffset = tmpPlanner.offset() + tmpToOut;
+            // composed in place if the temporary medium allows; nothing else goes to tmpPlanner until it is appended
+            Ptr<Burner> dirBurner = tmpPlanner.stage( blkSz );
+            dirBurner->reserve( draft.records->offset() );
+            dirBurner->append( Extent( 0, draft.records->offset(), draft.records ) );
+            draft.records.reset();
+            // the staged data may move as it grows; address the entries after appending
+            auto entryAt = [&dirBurner]( off64_t offset ) -> DirectoryEntry &
+            { return *( DirectoryEntry * )( ( char * ) dirBurner->data() + offset ); };
+
+            entryAt( ownOffset ).extentLba = dirOffset / blkSz;
+            entryAt( parentOffset ).extentLba = dirOffset / blkSz;
+            PathEntry * parent = pDir->parent ? pDir->parent : pDir;
+            parents.add( parent, dirBurner, parentOffset ); // for date, LBA and length
+            for( auto & sub : draft.subs )
+            {
+                // the offset is in target dev coordinates
+                const Extent & xt = fsFolders.at( sub.second ).extent;
+                entryAt( sub.first ).extentLba = xt.offset / blkSz;
+                entryAt( sub.first ).length = xt.length;
+            }
 
             tmpPlanner.append( WrapToGo( dirBurner ) ); // directory extent roundup
             Extent ownExtent = Extent( dirOffset, dirBurner->offset(), dirBurner );
-            ownSize( ownExtent );
-            fsFolders[pDir].extent = ownExtent;
+            entryAt( ownOffset ).length = ownExtent.length;
+            fsFolders.at( pDir ).extent = ownExtent;
+            if( !pDir->parent )
+            {
+                vol.vol->rootDirectory = entryAt( ownOffset );
+                vol.vol->rootDirectory.length = model.length;
+            }
 
             // propagate to children
-            auto catchup = parents.find( pDir );
-            if( catchup != parents.end() )
+            parents.settle( pDir, [&]( DirectoryEntry & link )
             {
-                for( auto & use : catchup->second ) { use( ownExtent ); }
-                //1// parents.erase( catchup ); // MOREINFO will it speed up lookup?
-            }
-        }
-        dot.fileName.data[0] = 0; // root again
+                link.dateTime = pDir->stat.st_mtim;
+                link.extentLba = ownExtent.offset / blkSz; // as above, tmpPlanner.offset() + tmpToOut
+                link.length = ownExtent.length;
+            } );
+        };
+        DraftFolders<Draft>( tree.pathTable, _jobs, encode, place );
 
         std::map<Unicode, Entry *> pTab;
 
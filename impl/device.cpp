@@ -35,13 +35,25 @@ blksize_t AsUpperBound( blksize_t mask )
 Ptr<DiskMedium> DeviceMap::surface( dev_t device, blksize_t blkSize )
 {
     Ptr<DiskMedium> & out = media[device];
-    // substitute[device] must be defined
-    return out || ( out = New<DiskMedium>( substitute[device], blkSize ) ), out;
+    if( !out )
+    {
+        auto itr = substitute.find( device );
+        dev_t used = device;
+        if( itr != substitute.end() ) { used = itr->second; }
+        else
+        {
+            printf( "Device %u:%u has no substitution; exposing it directly\n",
+                    major( device ), minor( device ) );
+        }
+        out = New<DiskMedium>( used, blkSize );
+    }
+    return out;
 }
 
 size_t ExtentIoc::S( int extents ) { return sizeof( struct fiemap ) + extents * sizeof( struct fiemap_extent ); }
 
 ExtentIoc::ExtentIoc() : extCount( 1 ), fem( ( struct fiemap * ) malloc( S( extCount ) ) )
+    , fallback( New<BlockMapIoc>( *this ) )
 {
     fem->fm_start = 0;
     fem->fm_flags = 0; // FIEMAP_FLAG_CACHE? rly needed?
@@ -88,6 +100,12 @@ ExtentIoc::ExtentIoc( MkfsConf & cfg ) : ExtentIoc() // pull the substitution ma
     } );
 }
 
+ExtentIoc::~ExtentIoc()
+{
+    stop();
+    free( fem );
+}
+
 void ExtentIoc::reserve( size_t newCount )
 {
     if( newCount > extCount )
@@ -99,9 +117,119 @@ void ExtentIoc::reserve( size_t newCount )
 
 ExtentList ExtentIoc::resolve( const Extent & source )
 {
+    if( noFiemap.count( source.medium->blockDevice() ) ) { return fallback->resolve( source ); }
     return peek( source, Correction::Naive );
 }
 
+ExtentList ExtentIoc::inPlace( const Extent & source )
+{
+    return peek( source, Correction::InPlace );
+}
+
+void ExtentIoc::defer( const Extent & source )
+{
+    waitlog.push_back( source );
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        _unflushed.push_back( source.medium->fd() );
+    }
+    if( !_flusher.joinable() ) { _flusher = std::thread( &ExtentIoc::flush, this ); }
+    _wake.notify_one();
+}
+
+void ExtentIoc::flush()
+{
+    // with many files pending, one syncfs() per device beats an fdatasync() per file
+    constexpr const size_t kSweep = 16;
+
+    std::unique_lock<std::mutex> lock( _guard );
+    while( true )
+    {
+        _wake.wait( lock, [this]() { return _closing || !_unflushed.empty(); } );
+        if( _unflushed.empty() ) { return; } // closing
+        std::vector<int> batch;
+        batch.swap( _unflushed );
+        lock.unlock();
+
+        if( batch.size() >= kSweep )
+        {
+            std::map<dev_t, int> devices;
+            struct stat64 st;
+            for( int fd : batch )
+            { if( fstat64( fd, &st ) >= 0 ) { devices.insert( std::make_pair( st.st_dev, fd ) ); } }
+            for( auto & device : devices )
+            { if( sync_filesystem( device.second ) < 0 ) { perror( "syncfs" ); } }
+        }
+        else
+        {
+            for( int fd : batch )
+            { if( fdatasync( fd ) < 0 ) { perror( "fdatasync" ); } }
+        }
+
+        lock.lock();
+    }
+}
+
+void ExtentIoc::stop()
+{
+    if( !_flusher.joinable() ) { return; }
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        _closing = true;
+    }
+    _wake.notify_all();
+    _flusher.join();
+    _closing = false;
+}
+
+void ExtentIoc::review( Revise revise )
+{
+    stop();
+
+    std::vector<std::pair<Extent, ExtentList>> settled;
+    if( !waitlog.empty() )
+    {
+        printf( "Re-resolving %lu files with unallocated or unwritten extents\n", waitlog.size() );
+        for( auto & source : waitlog ) { settled.emplace_back( source, peek( source, Correction::Fsync ) ); }
+        waitlog.clear();
+    }
+    // files of devices without FIEMAP; those FIBMAP can't map come as placeholders too
+    fallback->review( [&settled]( const Extent & source, const ExtentList & fresh )
+    { settled.emplace_back( source, fresh ); } );
+
+    // placeholders of the unmappable extents: adopt them smallest first,
+    // so that the budget covers as many files as possible
+    std::vector<std::pair<Extent *, const Extent *>> orphans;
+    for( auto & item : settled )
+    {
+        for( auto & extent : item.second )
+        { if( !extent.medium ) { orphans.emplace_back( &extent, &item.first ); } }
+    }
+    std::stable_sort( orphans.begin(), orphans.end(), []( const std::pair<Extent *, const Extent *> & left,
+                                                          const std::pair<Extent *, const Extent *> & right )
+    {
+        return left.first->length < right.first->length;
+    } );
+    for( auto & orphan : orphans )
+    {
+        Extent & extent = *orphan.first;
+        extent = adopt( Extent( extent.offset, extent.length, orphan.second->medium ) );
+    }
+
+    if( fosterHouse ) { fosterHouse->drain(); }
+    for( auto & item : settled ) { revise( item.first, item.second ); }
+}
+
+Extent ExtentIoc::adopt( const Extent & logical )
+{
+    if( fosterHouse ) { return fosterHouse->adopt( logical ); }
+
+    // expose a zero medium instead of the (insecure!) zero offset
+    fprintf( stderr, "*** Zeroed %s %lx+%lx (no adoption budget)\n",
+             logical.medium->path() ? logical.medium->path() : "?", logical.offset, logical.length );
+    return Extent( 0, logical.length, New<ZeroMedium>() );
+}
+
 ExtentList ExtentIoc::peek( const Extent & source, Correction co )
 {
     ExtentList xList;
@@ -111,14 +239,26 @@ ExtentList ExtentIoc::peek( const Extent & source, Correction co )
     fem->fm_start = source.offset;
     fem->fm_length = source.length;
     fem->fm_extent_count = 0;
-    fem->fm_flags = ( co == Correction::Fsync ) ? FIEMAP_FLAG_SYNC : 0;
-    off64_t budget = fosterHouse.get() ? adoptionBudget : -1;
+    fem->fm_flags = ( co == Correction::Fsync || co == Correction::InPlace ) ? FIEMAP_FLAG_SYNC : 0;
     int fd = source.medium->fd();
+    bool pending = false; // to be re-resolved on review()
     if( ioctl( fd, FS_IOC_FIEMAP, fem ) >= 0 )
     {
         reserve( fem->fm_extent_count = fem->fm_mapped_extents );
         if( ioctl( source.medium->fd(), FS_IOC_FIEMAP, fem ) >= 0 )
         {
+            if( co == Correction::Naive )
+            {
+                // a file re-resolved on review() is adopted there as a whole:
+                // adopting its small extents now would copy them twice
+                for( size_t extNo = 0; extNo < fem->fm_mapped_extents && !pending; extNo++ )
+                {
+                    struct fiemap_extent & rawx = fem->fm_extents[extNo];
+                    pending = ( rawx.fe_flags & ( FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_UNWRITTEN ) )
+                              || ( ( rawx.fe_flags & ( FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_NOT_ALIGNED ) )
+                                   && fosterHouse && ( off64_t ) rawx.fe_length > fosterHouse->eagerLimit() );
+                }
+            }
             for( size_t extNo = 0; extNo < fem->fm_mapped_extents; extNo++ )
             {
                 struct fiemap_extent & rawx = fem->fm_extents[extNo];
@@ -129,9 +269,10 @@ ExtentList ExtentIoc::peek( const Extent & source, Correction co )
                 // FIEMAP_EXTENT_UNKNOWN [covers FIEMAP_EXTENT_DELALLOC or drive unavailable (can't be)]
                 if( rawx.fe_flags & FIEMAP_EXTENT_UNKNOWN )
                 {
-                    if( co != Correction::Fsync )
+                    if( co == Correction::Naive )
                     {
-                        return peek( source, Correction::Fsync );
+                        pending = true; // the physical offset is meaningless: omit it for now
+                        continue;
                     }
 
                     fprintf( stderr, "Logical extent %lx+%lx unallocated - fsync failed\n",
@@ -155,37 +296,35 @@ ExtentList ExtentIoc::peek( const Extent & source, Correction co )
 
                 if( cantMap )
                 {
-                    off64_t offset = fosterHouse.get() ? fosterHouse->offset() : 0;
-                    if( offset + ( off64_t ) rawx.fe_length <= budget )
+                    if( co == Correction::InPlace ) { return {}; } // nothing is adopted
+                    Extent logical( rawx.fe_logical, rawx.fe_length, source.medium );
+                    if( co != Correction::Naive )
                     {
-                        // transfer the file to a temporary storage and expose the temporary medium
-                        Extent logical( rawx.fe_logical, rawx.fe_length, source.medium );
-                        Extent wrapped = fosterHouse->wrapToGo( fosterHouse->append( logical ) );
-                        xList.emplace_back( wrapped );
-                        continue;
+                        // a placeholder, adopted by review() in the order of length
+                        xList.emplace_back( logical.offset, logical.length, nullptr );
                     }
-                    else
+                    else if( !pending ) // otherwise, put aside until all the candidates are known
                     {
-                        fprintf( stderr, "*** Adoption budget exceeded! %lx+%lx<%lx\n",
-                                 offset, ( off64_t ) rawx.fe_length, budget );
-
-                        // expose a zero medium instead of the (insecure!) zero offset
-                        Extent blank( 0, rawx.fe_length, New<ZeroMedium>() );
-                        xList.emplace_back( blank );
-                        continue;
+                        // transfer the data to the temporary storage and expose the temporary medium
+                        xList.emplace_back( adopt( logical ) );
                     }
+                    continue;
                 }
 
                 // Need to wait until the data have flushed:
                 // FIEMAP_EXTENT_UNWRITTEN
                 if( rawx.fe_flags & FIEMAP_EXTENT_UNWRITTEN )
                 {
-                    // don't wait here. put the fd in the waitlog.
-                    // TODO: review the waitlog once the rest is done
-                    fprintf( stderr, "Physical extent %lx+%lx not yet written\n",
-                             ( off64_t ) rawx.fe_physical,
-                             ( off64_t ) rawx.fe_length );
-                    waitlog.push_back( fd );
+                    // don't wait here. put the source in the waitlog.
+                    if( co == Correction::Naive ) { pending = true; }
+                    else
+                    {
+                        fprintf( stderr, "Physical extent %lx+%lx not yet written\n",
+                                 ( off64_t ) rawx.fe_physical,
+                                 ( off64_t ) rawx.fe_length );
+                        // the mapped blocks would expose stale data rather than zeros
+                        if( co == Correction::InPlace ) { return {}; }
+                    }
                 }
 
                 Extent extent( rawx.fe_physical, rawx.fe_length, medium );
@@ -193,13 +332,132 @@ ExtentList ExtentIoc::peek( const Extent & source, Correction co )
             }
         }
     }
+    else if( co == Correction::InPlace ) { perror( "FIEMAP" ); return {}; }
+    else if( errno == EOPNOTSUPP || errno == ENOTTY )
+    {
+        dev_t device = source.medium->blockDevice();
+        printf( "No FIEMAP on device %u:%u; falling back to FIBMAP\n", major( device ), minor( device ) );
+        noFiemap.insert( device );
+        return fallback->resolve( source );
+    }
+    else { perror( "FIEMAP" ); }
 
+    if( pending ) { defer( source ); }
     return xList;
 }
 
+ExtentList BlockMapIoc::resolve( const Extent & source )
+{
+    if( source.length <= 0 ) { return {}; }
+
+    // the device map isn't shared with the workers
+    Ptr<DiskMedium> surface = _devices.surface( source.medium->blockDevice(),
+                                                source.medium->blockSize() );
+    _workers.post( [this, source, surface]()
+    {
+        int fd = source.medium->fd();
+        int blkSz = 0;
+        std::vector<Run> runs;
+        if( ioctl( fd, FIGETBSZ, &blkSz ) < 0 || blkSz <= 0 ) { perror( "FIGETBSZ" ); }
+        else
+        {
+            fdatasync( fd ); // unallocated blocks would read as holes
+            blkcnt_t first = source.offset / blkSz;
+            blkcnt_t count = ( source.offset + source.length + blkSz - 1 ) / blkSz - first;
+            runs = Map( fd, first, count );
+        }
+        ExtentList extents;
+        if( runs.empty() )
+        {
+            // e.g. EPERM without CAP_SYS_RAWIO: a placeholder, to be adopted like unmappable extents
+            fprintf( stderr, "Can't map %s\n", source.medium->path() ? source.medium->path() : "?" );
+            extents.emplace_back( source.offset, source.length, nullptr );
+        }
+        else { extents = Translate( source, runs, blkSz, surface ); }
+
+        std::lock_guard<std::mutex> lock( _guard );
+        _mapped.emplace_back( source, extents );
+    } );
+    return {};
+}
+
+void BlockMapIoc::review( Revise revise )
+{
+    _workers.drain();
+    if( _mapped.empty() ) { return; }
+
+    printf( "Mapped %lu files with FIBMAP\n", _mapped.size() );
+    for( auto & item : _mapped ) { revise( item.first, item.second ); }
+    _mapped.clear();
+}
+
+std::vector<BlockMapIoc::Run> BlockMapIoc::Map( int fd, blkcnt_t first, blkcnt_t count )
+{
+    int blkSz = 0;
+    if( ioctl( fd, FIGETBSZ, &blkSz ) < 0 || blkSz <= 0 ) { perror( "FIGETBSZ" ); return {}; }
+
+    auto at = [fd]( blkcnt_t logical ) -> blkcnt_t
+    {
+        int block = ( int ) logical;
+        if( block != logical || ioctl( fd, FIBMAP, &block ) < 0 ) { return -1; }
+        return block;
+    };
+
+    std::vector<Run> runs;
+    blkcnt_t last = first + count;
+    for( blkcnt_t logical = first; logical < last; )
+    {
+        blkcnt_t physical = at( logical );
+        if( physical < 0 ) { perror( "FIBMAP" ); return {}; }
+
+        if( !physical )
+        {
+            // skip holes without probing each block: ask for the next data instead
+            // (a filesystem without SEEK_DATA reports the offset itself)
+            off64_t data = lseek64( fd, logical * blkSz, SEEK_DATA );
+            blkcnt_t next = data < 0 ? last : std::min<blkcnt_t>( data / blkSz, last );
+            if( next <= logical ) { for( next = logical + 1; next < last && !at( next ); ++next ) {} }
+            runs.push_back( { logical, 0, next - logical } );
+            logical = next;
+            continue;
+        }
+
+        // every block is probed: a FAT cluster chain may leave the run and come back to it
+        blkcnt_t length = 1;
+        while( logical + length < last && at( logical + length ) == physical + length ) { ++length; }
+        runs.push_back( { logical, physical, length } );
+        logical += length;
+    }
+    return runs;
+}
+
+ExtentList BlockMapIoc::Translate( const Extent & source, const std::vector<Run> & runs,
+                                   blksize_t blkSz, Ptr<DiskMedium> surface )
+{
+    ExtentList extents;
+    off64_t end = source.offset + source.length;
+    for( auto & run : runs )
+    {
+        off64_t logical = run.logical * blkSz;
+        off64_t length = std::min<off64_t>( run.count * blkSz, end - logical );
+        if( run.physical ) { extents.emplace_back( run.physical * blkSz, length, surface ); }
+        else { extents.emplace_back( 0, length, New<ZeroMedium>() ); } // a hole
+    }
+    return extents;
+}
+
 void Geometry::chart( const ExtentList & extents )
 {
     if( extents.empty() ) { return; }
+    std::set<med_id> seen;
+    for( auto & extent : extents )
+    {
+        med_id medId = extent.medium ? extent.medium->id() : 0;
+        Census & stat = census[medId];
+        if( seen.insert( medId ).second ) { stat.files++; }
+        stat.extents++;
+        stat.bytes += extent.length;
+    }
     auto itr = extents.begin();
     while( true )
     {
@@ -327,6 +585,38 @@ blksize_t Geometry::granularity( blksize_t mapperBlock ) const
     return ~( AsLowerBound( mask ) << 1 );
 }
 
+void Geometry::reset()
+{
+    dMap.clear();
+    plan.clear();
+    census.clear();
+    mask = 0;
+}
+
+off64_t Geometry::gapOf( med_id medId ) const
+{
+    auto itr = gaps.find( dMap.at( medId )->blockDevice() );
+    return itr == gaps.end() ? gap : itr->second;
+}
+
+void Geometry::report() const
+{
+    printf( "Backing devices: %lu\n", plan.size() );
+    for( auto & presence : plan )
+    {
+        const Medium & medium = *dMap.at( presence.first );
+        dev_t devId = medium.blockDevice();
+        auto itr = census.find( presence.first );
+        Census stat = itr == census.end() ? Census() : itr->second;
+        if( medium.isAligned() )
+        {
+            printf( "  %u:%u (block %lu): %lu files, %lu extents, %ld bytes\n",
+                    major( devId ), minor( devId ), medium.blockSize(),
+                    stat.files, stat.extents, stat.bytes );
+        }
+    }
+}
+
 void Geometry::analyze( blksize_t blkSz, const Territory & extents, blksize_t targetBlkSz, off64_t net ) const
 {
     printf( "Remainder breakdown under a larger (%lu) cluster:\n", targetBlkSz );
@@ -437,8 +727,10 @@ void Geometry::optimize( blksize_t targetBlkSz )
         //        };
 
         // for( blksize_t gap : gaps ) { ... }
-        printf( "Merging extents with gap <= %lu\n", gap );
-        MergeExtents( extents, gap );
+        off64_t tolerance = gapOf( medId );
+        dev_t devId = dMap.at( medId )->blockDevice();
+        printf( "Merging extents on %u:%u with gap <= %lu\n", major( devId ), minor( devId ), tolerance );
+        MergeExtents( extents, tolerance );
         off64_t gross = TotalLength( extents );
         printf( "Extents after / past merging: %lu ∑: %ld leak: % .1f % % \n",
                 extents.size(), gross, 100.f * ( gross - net ) / net );
@@ -476,3 +768,23 @@ off64_t Colonies::withinArea( const Extent & xt ) const
 {
     return withinDisk( xt ) - areaOffset;
 }
+
+std::vector<Range> Colonies::translate( const ExtentList & xl, off64_t maxRun ) const
+{
+    std::vector<Range> runs;
+    for( const Extent & xt : xl )
+    {
+        off64_t offset = withinDisk( xt ), length = xt.length;
+        while( length )
+        {
+            bool joins = runs.size() && runs.back().offset + runs.back().length == offset
+                         && ( !maxRun || runs.back().length < maxRun );
+            if( !joins ) { runs.push_back( { offset, 0 } ); }
+            off64_t take = maxRun ? std::min( length, maxRun - runs.back().length ) : length;
+            runs.back().length += take;
+            offset += take;
+            length -= take;
+        }
+    }
+    return runs;
+}
@@ -12,6 +12,12 @@
 #include "conf/config.h"
 #include "impl/source.h"
 #include "impl/burner.h"
+#include "impl/adopt.h"
+#include "impl/worker.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 /// A map of source devices containing all the files passed in.
 struct DeviceMap
@@ -27,6 +33,8 @@ struct DeviceMap
     void subst( dev_t device, dev_t surface ) { substitute[device] = surface; }
 
     /// Return the DiskMedium backing the provided device, possibly creating it.
+    /// A device without a substitution is exposed as is (that only works if
+    /// it's not mounted, e.g. an SD card mirrored by the user beforehand).
     /// @param device   mounted filesystem device to represent
     /// @param blkSize  the block size of the surface device obtained from stat[64]
     Ptr<DiskMedium> surface( dev_t device, blksize_t blkSize );
@@ -40,8 +48,52 @@ struct NoLocator : public ILocator
     ExtentList resolve( const Extent & source ) { return { source }; }
 };
 
+/// A fallback locator for filesystems without FIEMAP (e.g. vfat or exfat on
+/// older kernels), querying the physical block of each logical block with
+/// the FIBMAP ioctl (which requires CAP_SYS_RAWIO). Every data block is probed:
+/// a FAT cluster chain may leave a run and come back to it, so matching run
+/// ends don't prove the blocks between them contiguous. Holes are skipped
+/// with SEEK_DATA where available.
+/// Files are mapped by a pool of workers; resolve() returns nothing and the
+/// extents are delivered by review(). A file that can't be mapped (e.g. FIBMAP
+/// is not permitted) is delivered as a placeholder extent without a medium.
+struct BlockMapIoc : public ILocator
+{
+    /// A run of logical blocks mapped to contiguous physical blocks (0: a hole).
+    struct Run
+    {
+        blkcnt_t logical;
+        blkcnt_t physical;
+        blkcnt_t count;
+    };
+
+    /// Map the files of the devices (mapped to their surfaces) with the provided
+    /// number of threads (zero: one per CPU core).
+    BlockMapIoc( DeviceMap & devices, unsigned workers = 0 ) : _devices( devices ), _workers( workers ) {}
+
+    /// Queue the file for mapping.
+    ExtentList resolve( const Extent & source ) override;
+
+    /// Wait for the queued files and present their extents (or placeholders).
+    void review( Revise revise ) override;
+
+    /// Return the runs of count blocks since the first one, or nothing on failure.
+    static std::vector<Run> Map( int fd, blkcnt_t first, blkcnt_t count );
+
+private:
+    /// Convert the runs of the source file to extents of the surface device.
+    static ExtentList Translate( const Extent & source, const std::vector<Run> & runs,
+                                 blksize_t blkSz, Ptr<DiskMedium> surface );
+
+    DeviceMap & _devices;
+    std::mutex _guard;
+    std::vector<std::pair<Extent, ExtentList>> _mapped;
+    Workers _workers; // last: joined before the members above go away
+};
+
 /// A locator returning the list of actual storage device extents backing
-/// the provided file. The FS_IOC_FIEMAP ioctl is used on Linux.
+/// the provided file. The FS_IOC_FIEMAP ioctl is used on Linux; files of
+/// filesystems without it are passed to a BlockMapIoc.
 struct ExtentIoc : public ILocator, public DeviceMap
 {
     /// reserve the backing memory chunk to accommodate newCount extents.
@@ -49,16 +101,45 @@ struct ExtentIoc : public ILocator, public DeviceMap
 
     ExtentIoc();
     ExtentIoc( MkfsConf & cfg );
+    ~ExtentIoc();
     ExtentList resolve( const Extent & source );
 
+    /// Wait for the background flush of the files with unallocated or unwritten
+    /// extents and resolve them again. Extents still unallocated are adopted,
+    /// as well as the large unmappable extents put aside during the scan and
+    /// the files the FIBMAP fallback couldn't map.
+    void review( Revise revise ) override;
+
+    /// Copy the unmappable extents to the provided foster house. Without one,
+    /// such extents are exposed as zeros.
+    void foster( Ptr<Adopter> house ) { fosterHouse = house; }
+
+    /// Resolve a written file that has to be mapped in place as it is (such as
+    /// a pinned temporary medium): nothing is adopted, deferred or zeroed.
+    /// Return nothing if any extent is encoded, inlined, unallocated or unwritten.
+    ExtentList inPlace( const Extent & source );
+
 private:
     static size_t S( int extents );
 
+    /// Put the source on the waitlog and let the flusher thread sync its file.
+    void defer( const Extent & source );
+
+    /// The flusher thread body: fdatasync() the queued files in batches.
+    void flush();
+
+    /// Stop the flusher thread, letting it complete the queued syncs.
+    void stop();
+
+    /// Return the extent of the foster house exposing the logical extent.
+    Extent adopt( const Extent & logical );
+
     enum Correction
     {
         Naive = 0,
         Fsync,
         Retry,
+        InPlace, ///< strict: no placeholders, no adoption
     };
 
     ExtentList peek( const Extent & source, Correction correction );
@@ -66,10 +147,17 @@ private:
     size_t extCount;
     struct fiemap * fem;
 
-    Ptr<Planner> fosterHouse;
-    off64_t adoptionBudget = 0;
+    Ptr<Adopter> fosterHouse;
+    Ptr<BlockMapIoc> fallback;
+    std::set<dev_t> noFiemap; ///< devices whose filesystems lack FIEMAP
+
+    std::vector<Extent> waitlog; ///< sources to re-resolve on review()
 
-    std::vector<int> waitlog;
+    std::thread _flusher;
+    std::mutex _guard;
+    std::condition_variable _wake;
+    std::vector<int> _unflushed; ///< fds queued for the flusher
+    bool _closing = false;
 };
 
 /// Extents of the source device occupied by the files we need to represent.
@@ -98,6 +186,12 @@ struct Colonies //: public Blocks // make output of optimize()
     /// Offset of the source extent within the file area of the target device.
     off64_t withinArea( const Extent & xt ) const;
 
+    /// The runs of the target device holding a file: its source extents translated
+    /// with withinDisk() and coalesced where they are contiguous on the target.
+    /// The lengths stay byte-exact. If maxRun (a multiple of the target block size)
+    /// is set, runs are split so that none is longer.
+    std::vector<Range> translate( const ExtentList & xl, off64_t maxRun = 0 ) const;
+
     // everything in areaOffset reference frame divides by...
     // blksize_t blockSize() const override { return targetBlkSz; }
 
@@ -113,6 +207,14 @@ blksize_t AsLowerBound( blksize_t mask );
 /// Set all bits below the highest "1" bit.
 blksize_t AsUpperBound( blksize_t mask );
 
+/// Per-device statistics of the represented files.
+struct Census
+{
+    size_t files = 0;   ///< files having at least one extent on the device
+    size_t extents = 0; ///< extents as reported by the locator
+    off64_t bytes = 0;  ///< the net length of the extents
+};
+
 struct Geometry
 {
     /// Registers the Extent list in the source area charts, updating the granularity mask.
@@ -138,6 +240,15 @@ struct Geometry
     /// Identify the granularity of the represented extents (largest possible block size).
     blksize_t granularity( blksize_t mapperBlock = Blocks::MAPPER_BS ) const;
 
+    /// Return the extent merging tolerance of the provided source medium.
+    off64_t gapOf( med_id medId ) const;
+
+    /// Forget all the charted extents, keeping the merging configuration.
+    void reset();
+
+    /// Display the per-device statistics.
+    void report() const;
+
     /// Display the "laning" efficiency metrics.
     void analyze( blksize_t targetBlkSz ); // must have an oput (cost estimate)
 
@@ -155,6 +266,8 @@ struct Geometry
     Colonies writeFiles( Planner & out ) const { return writeFiles( out, out.blockSize() ); }
 
     off64_t gap = 0;
+    std::map<dev_t, off64_t> gaps; ///< per-device overrides of gap
+    std::map<med_id, Census> census;
     DevMedia dMap;
     Planetary plan;
     blksize_t mask = 0;
@@ -5,6 +5,11 @@
  */
 
 #include "impl/extent.h"
+#include "impl/simd.h"
+#include "impl/worker.h"
+
+#include <atomic>
+#include <mutex>
 
 namespace
 {
@@ -16,18 +21,117 @@ struct FileIO
     static void addFile( int outFd, int inFd, off64_t offset, off64_t length );
     static void addData( int outFd, const void * data, off64_t length );
     static void addZero( int outFd, off64_t length );
+
+    // positional counterparts
+    static void putFile( int outFd, off64_t at, int inFd, off64_t offset, off64_t length );
+    static void putData( int outFd, off64_t at, const void * data, off64_t length );
 };
 
+// Cleared on the first refusal other than a per-call one (alignment, device pair)
+std::atomic<bool> CanClone( true );
+std::atomic<bool> CanCopy( true );
+
+bool IsUnsupported( int error ) { return error == EOPNOTSUPP || error == ENOTTY || error == ENOSYS; }
+
 void FileIO::addFile( int outFd, int fd, off64_t offset, off64_t length )
 {
-    // The copy_file_range() system call first appeared in Linux 4.5
-    if( fd >= 0 )
+    if( fd < 0 ) { return; }
+
+    // Between regular files, try to share the data blocks (a metadata-only
+    // copy on btrfs, XFS...), then to copy in the kernel (possibly offloaded).
+    struct stat64 outSt;
+    bool regular = fstat64( outFd, &outSt ) >= 0 && S_ISREG( outSt.st_mode );
+    if( regular && CanClone && outSt.st_blksize > 0 )
+    {
+        // FICLONERANGE takes whole blocks at block-aligned offsets of both files
+        off64_t at = lseek64( outFd, 0, SEEK_CUR );
+        off64_t blkSz = outSt.st_blksize;
+        off64_t whole = length & ~( blkSz - 1 );
+        if( whole && !( offset % blkSz ) && !( at % blkSz ) )
+        {
+            struct file_clone_range range = { fd, ( __u64 ) offset, ( __u64 ) whole, ( __u64 ) at };
+            if( ioctl( outFd, FICLONERANGE, &range ) >= 0 )
+            {
+                lseek64( outFd, whole, SEEK_CUR );
+                offset += whole;
+                length -= whole;
+            }
+            else if( IsUnsupported( errno ) ) { CanClone = false; }
+        }
+    }
+    while( regular && CanCopy && length > 0 )
+    {
+        loff_t from = offset;
+        ssize_t done = syscall( __NR_copy_file_range, fd, &from, outFd, nullptr, ( size_t ) length, 0u );
+        if( done > 0 ) { offset += done; length -= done; continue; }
+        if( done < 0 && errno == EINTR ) { continue; }
+        if( done < 0 && IsUnsupported( errno ) ) { CanCopy = false; }
+        break; // EXDEV, EINVAL or a premature EOF: let sendfile() tell
+    }
+    if( length > 0 )
     {
         auto written = sendfile64( outFd, fd, &offset, length );
         if( written != length ) { perror( "sendfile" ); abort(); }
     }
 }
 
+void FileIO::putFile( int outFd, off64_t at, int fd, off64_t offset, off64_t length )
+{
+    if( fd < 0 ) { return; }
+
+    struct stat64 outSt;
+    bool regular = fstat64( outFd, &outSt ) >= 0 && S_ISREG( outSt.st_mode );
+    if( regular && CanClone && outSt.st_blksize > 0 )
+    {
+        off64_t blkSz = outSt.st_blksize;
+        off64_t whole = length & ~( blkSz - 1 );
+        if( whole && !( offset % blkSz ) && !( at % blkSz ) )
+        {
+            struct file_clone_range range = { fd, ( __u64 ) offset, ( __u64 ) whole, ( __u64 ) at };
+            if( ioctl( outFd, FICLONERANGE, &range ) >= 0 )
+            {
+                offset += whole;
+                at += whole;
+                length -= whole;
+            }
+            else if( IsUnsupported( errno ) ) { CanClone = false; }
+        }
+    }
+    while( regular && CanCopy && length > 0 )
+    {
+        loff_t from = offset, to = at;
+        ssize_t done = syscall( __NR_copy_file_range, fd, &from, outFd, &to, ( size_t ) length, 0u );
+        if( done > 0 ) { offset += done; at += done; length -= done; continue; }
+        if( done < 0 && errno == EINTR ) { continue; }
+        if( done < 0 && IsUnsupported( errno ) ) { CanCopy = false; }
+        break;
+    }
+
+    // sendfile() writes at the file position: bounce through memory instead
+    constexpr const size_t kChunk = 1 << 20;
+    std::vector<char> chunk( std::min<off64_t>( std::max<off64_t>( length, 0 ), kChunk ) );
+    while( length > 0 )
+    {
+        ssize_t got = pread64( fd, chunk.data(), std::min<off64_t>( length, chunk.size() ), offset );
+        if( got < 0 && errno == EINTR ) { continue; }
+        if( got <= 0 ) { perror( "pread" ); abort(); }
+        putData( outFd, at, chunk.data(), got );
+        offset += got; at += got; length -= got;
+    }
+}
+
+void FileIO::putData( int outFd, off64_t at, const void * data, off64_t length )
+{
+    const char * ptr = ( const char * ) data;
+    while( length > 0 )
+    {
+        auto written = pwrite64( outFd, ptr, length, at );
+        if( written < 0 && errno == EINTR ) { continue; }
+        if( written <= 0 ) { perror( "pwrite" ); abort(); }
+        ptr += written; at += written; length -= written;
+    }
+}
+
 void FileIO::addData( int outFd, const void * data, off64_t length )
 {
     auto written = write( outFd, data, length );
@@ -49,6 +153,50 @@ void FileIO::addZero( int outFd, off64_t length )
 
 constexpr const blksize_t Blocks::MAPPER_BS; // ...deprecated in C++17
 
+med_id NodeId( dev_t device, ino_t inode )
+{
+    static std::mutex guard;
+    static med_id slots = 0;                ///< the namespaces assigned so far
+    static std::map<dev_t, med_id> spaces;  ///< the namespace of each device
+    static std::map<dev_t, med_id> renumbered; ///< the last id of the namespace of wide inodes of each device
+    static std::map<std::pair<dev_t, ino_t>, med_id> wide;
+    // the per-file path asks for the same few devices: look them up without the lock
+    thread_local std::map<dev_t, med_id> known;
+
+    constexpr const int shift = 48;
+    auto newSlot = [&]() -> med_id
+    {
+        if( ++slots >> ( 64 - shift ) ) { printf( "Too many devices\n" ); abort(); }
+        return slots;
+    };
+    if( ( med_id ) inode >> shift )
+    {
+        // XFS and btrfs may use the full 64 bits: number such inodes anew, in a
+        // namespace of their own, so that they can't collide with the narrow ones
+        std::lock_guard<std::mutex> lock( guard );
+        med_id & id = wide[std::make_pair( device, inode )];
+        if( !id )
+        {
+            auto itr = renumbered.find( device );
+            if( itr == renumbered.end() ) { itr = renumbered.emplace( device, newSlot() << shift ).first; }
+            id = ++itr->second;
+            if( !( id & ( ( ( med_id ) 1 << shift ) - 1 ) ) )
+            { printf( "Too many wide inodes on device %u:%u\n", major( device ), minor( device ) ); abort(); }
+        }
+        return id;
+    }
+
+    auto itr = known.find( device );
+    if( itr == known.end() )
+    {
+        std::lock_guard<std::mutex> lock( guard );
+        med_id & slot = spaces[device];
+        if( !slot ) { slot = newSlot(); }
+        itr = known.emplace( device, slot ).first;
+    }
+    return itr->second << shift | inode;
+}
+
 // most generic. specializations can reduce complexity.
 void Medium::writeToFd( int outFd, const Range & range ) const
 {
@@ -70,6 +218,25 @@ void Medium::writeToFd( int outFd, const Range & range ) const
     else { FileIO::addZero( outFd, range.length ); }
 }
 
+void Medium::writeToFd( int outFd, const Range & range, off64_t at ) const
+{
+    if( data() )
+    {
+        FileIO::putData( outFd, at, ( const char * ) data() + range.offset, range.length );
+    }
+    else if( fd() >= 0 )
+    {
+        FileIO::putFile( outFd, at, fd(), range.offset, range.length );
+    }
+    else if( path() )
+    {
+        int fd = open( path(), O_RDONLY );
+        FileIO::putFile( outFd, at, fd, range.offset, range.length );
+        close( fd );
+    }
+    // else: zeros
+}
+
 std::function<int ()> FdOf( Ptr<Medium> medium )
 {
     return [medium]()
@@ -92,6 +259,13 @@ void Extent::writeToFd( int fd ) const
     else { FileIO::addZero( fd, length ); }
 }
 
+void Extent::writeToFd( int fd, off64_t at ) const
+{
+    if( medium.get() ) { medium->writeToFd( fd, *this, at ); }
+}
+
+ExtentList Medium::locate( const Range & /*range*/ ) const { return {}; }
+
 FileMedium::FileMedium( int inFd ) : _fd( inFd ) { fstat64( _fd, &_st ); }
 
 dev_t FileMedium::blockDevice() const { return _st.st_dev; }
@@ -102,29 +276,65 @@ void RuleMedium::writeToFd( int outFd, const Range & range ) const
 {
     // careful with ZRAM seeks! (and any other block device)
     off64_t base = lseek64( outFd, 0, SEEK_CUR );
+    writeToFd( outFd, range, base );
+    lseek64( outFd, base + range.length, SEEK_SET );
+}
+
+void RuleMedium::writeToFd( int outFd, const Range & range, off64_t at ) const
+{
+    // chunks are pure functions of their offsets: threads claim them in order,
+    // each generating into its own reused buffer and writing in place
     off64_t size = chunkSize();
-    void * chunk = memalign( blockSize(), size );
+    off64_t count = ( range.length + size - 1 ) / size;
     off64_t last = range.offset + range.length;
-    for( off64_t next = range.offset; next < last; next += size )
+    std::atomic<off64_t> claimed( 0 );
+    auto render = [&]()
     {
-        auto part = std::min( last - next, size );
-        fill( chunk, next, part );
-        write( outFd, chunk, part );
-    }
-    for( auto & amendment : amendments )
-    { amendment.second( outFd, base ); }
+        void * chunk = memalign( blockSize(), size );
+        for( off64_t index; ( index = claimed++ ) < count; )
+        {
+            off64_t next = range.offset + index * size;
+            auto part = std::min( last - next, size );
+            generate( chunk, next, part );
+            FileIO::putData( outFd, at + next - range.offset, chunk, part );
+        }
+        free( chunk );
+    };
+
+    constexpr const off64_t kBytesPerJob = 4 << 20; // not worth a thread below that
+    off64_t jobs = std::min<off64_t>( std::min<off64_t>( std::thread::hardware_concurrency(), count ),
+                                      range.length / kBytesPerJob );
+    // on a worker already (e.g. of Planner::commitParallel()), don't multiply the threads
+    if( jobs <= 1 || Workers::Inside() ) { render(); return; }
+    Workers workers( jobs );
+    for( off64_t job = 0; job < jobs; ++job ) { workers.post( render ); }
+    workers.drain();
+}
+
+off64_t RuleMedium::uniform( const Range & range, uint8_t & value ) const
+{
+    off64_t length = constant( range, value );
+    return amendments.next( range.offset, range.offset + length ) - range.offset;
 }
 
 void BitsMedium::fill( void * chunk, off64_t offset, size_t size ) const
 {
-    const ssize_t & ssize = size; // signed/unsigned warning
-    off64_t nOfFF = countOfFF() - offset;
-    off64_t nFill = std::min( nOfFF, ssize );
-    if( nFill >= 0 && nFill < ssize )
+    // 0xff up to countOfFF(), then the trailing byte (if any), then zeros
+    char * data = ( char * ) chunk;
+    off64_t end = offset + size;
+    off64_t ones = std::min( std::max( countOfFF(), offset ), end ) - offset;
+    Simd::Splat( data, 0xff, ones );
+    if( hasTrailingByte() && countOfFF() >= offset && countOfFF() < end ) { data[ones++] = trailingByte(); }
+    Simd::Splat( data + ones, 0, size - ones );
+}
+
+off64_t BitsMedium::constant( const Range & range, uint8_t & value ) const
+{
+    if( range.offset < countOfFF() )
     {
-        if( !( _skip_idle && offset ) ) { memset( chunk, 0xff, nFill ); }
-        char * data = ( char * ) chunk;
-        if( hasTrailingByte() ) { data[nFill++] = trailingByte(); }
-        if( nFill < ssize ) { memset( data + nFill, 0, size - nFill ); }
+        value = 0xff;
+        return std::min( range.length, countOfFF() - range.offset );
     }
+    value = 0;
+    return range.offset < byteCount() ? 0 : range.length; // the trailing byte
 }
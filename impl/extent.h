@@ -9,6 +9,8 @@
 
 #include "wrapper.h"
 
+#include "impl/fixup.h"
+
 #include <functional>
 #include <string>
 
@@ -70,82 +72,17 @@ struct Blocks
 struct Extent;
 using ExtentList = std::list<Extent>;
 
-/// A handful of definitions to represent "fixups"/"amendments" -
-/// stored actions to update a location in a file (fd) or in memory
-/// to store a value (typically a Range property, such as offset or length)
-/// that is only known Later in the computation.
-struct Later
-{
-    typedef std::function<void( int, off64_t )> Land;
-    typedef std::function<void( const Range & )> Use;
-    typedef std::function<void( int )> FdAction; // e.g. &fdatasync
-    static inline void NoAction( int ) {}
-
-    /// Store a future-known Range property as an arbitrary type P at a currently-known offset
-    /// within a currently-known fd.
-    /// E.g. the fd may represent a file system storage, and the offset a directory entry that will
-    /// be populated with a future-known location of a file "burned" to the storage after the entry.
-    /// @param[in]  fd      the target file descriptor
-    /// @param[in]  offset  the target offset
-    /// @param[in]  field   the field. Only the type of the value matters.
-    /// @param[in]  assign  the assignment function that represents
-    ///                     the later-provided Range as a value of type P.
-    /// @param[in]  commit  the post-assignment hook that finalizes the write (e.g. flushes the file).
-    template <typename P>
-    static inline Use Store( int fd, off64_t offset, const P & field,
-                             std::function<void( P &, const Range & )> assign,
-                             FdAction commit = &Later::NoAction )
-    {
-        return [fd, offset, field, assign, commit]( const Range & rvalue )
-        {
-            auto lvalue = field;
-            assign( lvalue, rvalue );
-            // POSIX specific part
-            pwrite( fd, &lvalue, sizeof( P ), offset );
-            commit( fd );
-        };
-    }
-
-    /// Store a currently-known value of an arbitrary type P at a currently-known offset
-    /// from a future-provided base in a future-provided fd. (In other words - "assign a
-    /// known value to a known field in an object stored at a future-known file location".)
-    /// @param[in] offset   the field offset
-    /// @param[in] value    the field value to assign
-    template <typename P>
-    static inline Land Store( off64_t offset, const P & value )
-    {
-        return [offset, value]( int fd, off64_t base )
-        {
-            // POSIX specific part
-            pwrite( fd, &value, sizeof( P ), base + offset );
-        };
-    }
-
-    /// Store a future-known Range property as a currently-known type P
-    /// at a currently-known offset from a future-retrievable memory address
-    /// (i.e. into a currently-known field of a future-located object).
-    /// @param data     the function to retrieve the base ("object") address.
-    /// @param offset   the field offset in the object.
-    /// @param field    the field. Only the type of the value matters.
-    /// @param assign   the assignment function that represents
-    ///                     the later-provided Range as a value of type P.
-    template <typename P>
-    static inline Use Store( std::function<char * ()> data, off64_t offset, const P & field,
-                             std::function<void( P &, const Range & )> assign )
-    {
-        return [data, offset, field, assign]( const Range & rvalue )
-        {
-            auto lvalue = field;
-            assign( lvalue, rvalue );
-            memcpy( data() + offset, &lvalue, sizeof( P ) );
-        };
-    }
-};
-
 typedef uintptr_t med_id;   ///< Medium id (used as a lightweight key in various maps)
 static_assert( sizeof( med_id ) >= sizeof( dev_t ), "Medium ID must accommodate dev_t" );
 static_assert( sizeof( med_id ) >= sizeof( ino_t ), "Medium ID must accommodate ino_t" );
 
+/// Return the Medium id of a regular file. Inode numbers are only unique within
+/// their device, so each st_dev gets a namespace: a small index assigned on first
+/// use and kept in the top 16 bits. Never collides with DiskMedium ids (dev_t).
+/// The rare inode numbers wider than the remaining 48 bits are numbered anew,
+/// in a namespace of their own per device.
+med_id NodeId( dev_t device, ino_t inode );
+
 /// The storage Medium, block-delimited.
 struct Medium : public Blocks
 {
@@ -175,6 +112,16 @@ struct Medium : public Blocks
 
     /// Writes the provided range of the medium to the provided fd.
     virtual void writeToFd( int outFd, const Range & range ) const;
+
+    /// Writes the provided range of the medium to the provided fd at the provided
+    /// offset, leaving the file position intact. Gaps (zeros) are not written:
+    /// the target is expected to be zero-filled. Disjoint output ranges may be
+    /// written concurrently.
+    virtual void writeToFd( int outFd, const Range & range, off64_t at ) const;
+
+    /// The extents of block devices holding the range, for a medium that can be
+    /// mapped indirectly, e.g. a file on a mounted partition. Nothing by default.
+    virtual ExtentList locate( const Range & range ) const;
 };
 
 /// medium->fd() bound as a function object
@@ -198,6 +145,9 @@ struct Extent : public Blocks, public Range
     /// Writes the data represented by the Extent to the provided fd.
     void writeToFd( int fd ) const;
 
+    /// Writes the data represented by the Extent to the provided fd at the provided offset.
+    void writeToFd( int fd, off64_t at ) const;
+
     Ptr<Medium> medium;
 };
 
@@ -207,7 +157,7 @@ struct FileMedium : public Medium
     FileMedium( int inFd, const struct stat64 & inSt ) : _fd( inFd ), _st( inSt ) {}
     FileMedium( int inFd );
     int fd() const override { return _fd; }
-    med_id id() const override { return _st.st_ino; }
+    med_id id() const override { return NodeId( _st.st_dev, _st.st_ino ); }
     dev_t blockDevice() const override;
     blksize_t blockSize() const override;
     bool isAligned() const override { return false; }
@@ -323,26 +273,44 @@ struct DiskMedium : public Medium
 };
 
 /// A Medium that generates its contents algorithmically.
-struct RuleMedium : public Medium, public Later
+struct RuleMedium : public Medium
 {
     virtual size_t chunkSize() const = 0;
 
     void writeToFd( int outFd, const Range & range ) const override;
 
-    /// A pure virtual method that needs implementation.
+    /// Generate the range with a pool of threads if it spans many chunks,
+    /// unless called on a worker thread already (see Workers::Inside()).
+    void writeToFd( int outFd, const Range & range, off64_t at ) const override;
+
+    /// A pure virtual method that needs implementation. Shall define the whole
+    /// chunk as a function of the offset alone: chunks are generated concurrently,
+    /// into reused buffers.
     virtual void fill( void * chunk, off64_t offset, size_t size ) const = 0;
 
-    /// An empty collection of exceptions to the rule that needs population.
-    std::map<off64_t, Land> amendments;
+    /// Fill the chunk and apply the amendments to it.
+    void generate( void * chunk, off64_t offset, size_t size ) const
+    { fill( chunk, offset, size ); amendments.apply( chunk, offset, size ); }
+
+    /// Return the length of the longest prefix of the range whose bytes are all
+    /// the same (amendments considered), setting the value; zero if unknown.
+    /// Lets a mapped target skip constant blocks (see Planner::dedup()).
+    off64_t uniform( const Range & range, uint8_t & value ) const;
+
+    /// An empty collection of exceptions to the rule that needs population and sealing.
+    Fixups amendments;
+
+protected:
+    /// The same as uniform(), but for the rule alone. Knows nothing by default.
+    virtual off64_t constant( const Range & /*range*/, uint8_t & /*value*/ ) const { return 0; }
 };
 
 /// A RuleMedium that fills itself with '1' bits.
 /// Used e.g. to populate the free/occupied bitmap of HFS.
 struct BitsMedium : public RuleMedium
 {
-    BitsMedium( bool singleExtent = false, size_t chunk = MAPPER_BS, off64_t bits = 0 )
-        : _skip_idle( singleExtent )
-        , _chunk_size( chunk )
+    BitsMedium( size_t chunk = MAPPER_BS, off64_t bits = 0 )
+        : _chunk_size( chunk )
         , _bits( bits )
     {}
 
@@ -354,7 +322,7 @@ struct BitsMedium : public RuleMedium
     inline bool hasTrailingByte() const { return _bits % 8; }
     inline char trailingByte() const { return ( 0xff00 >> ( _bits % 8 ) ); }
     void fill( void * chunk, off64_t offset, size_t size ) const override;
-    bool _skip_idle;
+    off64_t constant( const Range & range, uint8_t & value ) const override;
     size_t _chunk_size;
     off64_t _bits;
 };
@@ -365,6 +333,13 @@ struct ILocator
 {
     virtual ExtentList resolve( const Extent & source ) = 0;
 
+    /// A receiver of the final extent list of a source resolved earlier.
+    typedef std::function<void( const Extent & source, const ExtentList & fresh )> Revise;
+
+    /// Re-resolve the sources whose extents weren't final at resolve() time
+    /// (e.g. not yet allocated or written), passing each of them to revise().
+    virtual void review( Revise /*revise*/ ) {}
+
 protected:
     virtual ~ILocator() = default;
 };
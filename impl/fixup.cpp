@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "fixup.h"
+
+void Fixups::record( off64_t offset, const void * value, uint32_t width, bool strong )
+{
+    _records.push_back( { offset, width, strong, _values.size() } );
+    _values.insert( _values.end(), ( const char * ) value, ( const char * ) value + width );
+    _max_width = std::max( _max_width, width );
+    _sealed = false;
+}
+
+void Fixups::seal()
+{
+    if( _sealed ) { return; }
+
+    // the insertion order breaks the ties
+    std::stable_sort( _records.begin(), _records.end(), []( const Record & left, const Record & right )
+    {
+        return left.offset < right.offset;
+    } );
+
+    // of the fixups at one offset, the last strong one or else the first weak one wins
+    size_t kept = 0;
+    for( size_t first = 0, next; first < _records.size(); first = next )
+    {
+        size_t winner = first;
+        for( next = first; next < _records.size() && _records[next].offset == _records[first].offset; ++next )
+        {
+            if( _records[next].strong ) { winner = next; }
+        }
+        _records[kept++] = _records[winner];
+    }
+    _records.resize( kept );
+    _sealed = true;
+}
+
+void Fixups::apply( void * chunk, off64_t offset, size_t size ) const
+{
+    if( _records.empty() ) { return; }
+    if( !_sealed ) { printf( "Fixups applied before seal()\n" ); abort(); }
+
+    // the first fixup that may reach into the chunk
+    off64_t since = offset - _max_width;
+    auto itr = std::lower_bound( _records.begin(), _records.end(), since, []( const Record & record, off64_t at )
+    {
+        return record.offset <= at;
+    } );
+
+    off64_t last = offset + size;
+    for( ; itr != _records.end() && itr->offset < last; ++itr )
+    {
+        off64_t from = std::max( itr->offset, offset );
+        off64_t till = std::min<off64_t>( itr->offset + itr->width, last );
+        if( from >= till ) { continue; }
+        memcpy( ( char * ) chunk + ( from - offset ), &_values[itr->value + ( from - itr->offset )], till - from );
+    }
+}
+
+off64_t Fixups::next( off64_t offset, off64_t till ) const
+{
+    if( _records.empty() ) { return till; }
+    if( !_sealed ) { printf( "Fixups looked up before seal()\n" ); abort(); }
+
+    off64_t since = offset - _max_width;
+    auto itr = std::lower_bound( _records.begin(), _records.end(), since, []( const Record & record, off64_t at )
+    {
+        return record.offset <= at;
+    } );
+
+    // sorted by offset: the first one reaching past the offset is the closest
+    for( ; itr != _records.end() && itr->offset < till; ++itr )
+    {
+        if( itr->offset + itr->width > offset ) { return std::max( itr->offset, offset ); }
+    }
+    return till;
+}
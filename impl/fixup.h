@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef FIXUP_H
+#define FIXUP_H
+
+#include "wrapper.h"
+
+/// "Fixups" (a.k.a. "amendments"): small values stored at known offsets of
+/// a medium whose bulk is generated or copied elsewhere, e.g. the cluster
+/// chains of a FAT that is otherwise a trivial sequence.
+///
+/// The values are kept by copy in flat vectors (no closure or allocation per
+/// fixup); once sealed, they are sorted by offset and applied in one merged
+/// pass to each chunk of the medium contents as the chunk is produced.
+class Fixups
+{
+public:
+    /// Store a value at the offset. Overrides whatever has been stored there.
+    template <typename P>
+    void put( off64_t offset, const P & value ) { record( offset, &value, sizeof( P ), true ); }
+
+    /// Store a value at the offset, unless another one is stored there (earlier or later).
+    template <typename P>
+    void putWeak( off64_t offset, const P & value ) { record( offset, &value, sizeof( P ), false ); }
+
+    /// Sort the fixups and resolve the overrides. Needed before apply().
+    void seal();
+
+    /// Return the number of fixups (once sealed, the effective number).
+    size_t size() const { return _records.size(); }
+
+    /// Apply the fixups to a chunk holding the [offset, offset + size) range
+    /// of the medium. Values crossing the chunk boundaries are clipped.
+    void apply( void * chunk, off64_t offset, size_t size ) const;
+
+    /// Return the first offset of the [offset, till) range that a fixup changes, or till.
+    off64_t next( off64_t offset, off64_t till ) const;
+
+private:
+    void record( off64_t offset, const void * value, uint32_t width, bool strong );
+
+    struct Record
+    {
+        off64_t offset;
+        uint32_t width;
+        uint32_t strong; ///< a boolean, padded
+        size_t value;    ///< the position in _values
+    };
+
+    std::vector<Record> _records;
+    std::vector<char> _values;
+    uint32_t _max_width = 0;
+    bool _sealed = true;
+};
+
+#endif // FIXUP_H
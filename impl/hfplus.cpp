@@ -31,6 +31,14 @@ NodeSpec::NodeSpec( BTNodeKind kind ) : NodeSpec() { desc.kind = kind; }
 
 NodeSpec::NodeSpec( BTNodeKind kind, uint8_t level ) : NodeSpec( kind ) { desc.height = level; }
 
+NodeSpec::NodeSpec( BTNodeKind kind, uint8_t level, blksize_t capacity ) : packed( capacity, 0 )
+{
+    desc.kind = kind;
+    desc.height = level;
+    offset = sizeof( desc );
+    markRecord();
+}
+
 size_t NodeSpec::freeSpace( blksize_t capacity, bool gross ) const
 { return capacity - size() - ( gross ? 0 : sizeof( NodeRecOff ) ); }
 
@@ -39,13 +47,33 @@ bool NodeSpec::fitsIn( blksize_t capacity, size_t recordSize ) const
 
 void NodeSpec::addRecord( const Extent & rec )
 {
+    if( packed.size() )
+    {
+        const char * mem = ( const char * ) rec.medium->data();
+        if( !mem ) { printf( "E unpackable record %lx+%lx\n", rec.offset, rec.length ); abort(); }
+        addRecord( mem + rec.offset, rec.length );
+        return;
+    }
     recs.push_back( rec );
     offset += rec.length;
 }
 
+void NodeSpec::addRecord( const void * ptr, size_t size )
+{
+    if( !packed.size() ) { addRecord( TempExtent( ptr, size ) ); return; }
+    if( offset + size > packed.size() ) { printf( "E node overrun of=%lx+%lx\n", offset, size ); abort(); }
+    memcpy( packed.data() + offset, ptr, size );
+    offset += size;
+}
+
 void NodeSpec::markRecord()
 {
-    offsets.insert( offsets.begin(), offset );
+    if( packed.size() ) // the offset table grows down from the end of the node
+    {
+        UInt16 mark = offset;
+        memcpy( packed.data() + packed.size() - offSize() - sizeof( mark ), &mark, sizeof( mark ) );
+    }
+    else { offsets.insert( offsets.begin(), offset ); }
     desc.numRecords = desc.numRecords + 1;
 }
 
@@ -56,7 +84,7 @@ void NodeSpec::addRecord( const ExtentList & xl )
 
 void NodeSpec::addRecord( const Record & record )
 {
-    addRecord( record.asExtentList() );
+    record.addTo( *this );
 }
 
 void NodeSpec::addRecord( Ptr<Record> record )
@@ -64,11 +92,23 @@ void NodeSpec::addRecord( Ptr<Record> record )
     addRecord( *record );
 }
 
-void NodeSpec::writeTo( IAppend & out, blksize_t capacity ) const
+void Record::addTo( NodeSpec & node ) const
+{
+    node.addRecord( asExtentList() );
+}
+
+void NodeSpec::writeTo( IAppend & out, blksize_t capacity )
 {
     // assert out aligned to capacity
     off64_t cur = out.offset();
     if( cur % Blocks::MAPPER_BS ) { printf( "E out misaligned of=%lx\n", cur ); abort(); }
+    if( packed.size() )
+    {
+        if( ( blksize_t ) packed.size() != capacity ) { printf( "E node size %lx != %lx\n", packed.size(), capacity ); abort(); }
+        memcpy( packed.data(), &desc, sizeof( desc ) );
+        out.append( TempExtent( packed.data(), packed.size() ) );
+        return;
+    }
     // printf( "%lu extents %lu offsets\n", recs.size(), offsets.size() );
     for( auto & record : recs ) { out.append( record ); }
     out.append( ZeroExtent( capacity - size() ) );
@@ -77,6 +117,109 @@ void NodeSpec::writeTo( IAppend & out, blksize_t capacity ) const
     if( out.offset() % Blocks::MAPPER_BS ) { printf( "X out misaligned of=%lx\n", out.offset() ); abort(); }
 }
 
+void FlatCatalog::append( const void * ptr, size_t size )
+{
+    const char * bytes = ( const char * ) ptr;
+    _arena.insert( _arena.end(), bytes, bytes + size );
+}
+
+void FlatCatalog::append( const Unicode & name )
+{
+    for( auto & wc : name )
+    {
+        UniChar uc = wc;
+        append( &uc, sizeof( uc ) );
+    }
+}
+
+void FlatCatalog::add( CNID parentID, const Unicode & keyName, const void * rec, size_t recSize, const Unicode & recName )
+{
+    Ref ref;
+    ref.parent = parentID;
+    ref.nameLen = keyName.size();
+    ref.prefix = 0;
+    for( size_t i = 0; i < 4 && i < keyName.size(); ++i )
+    { ref.prefix |= ( uint64_t ) ( uint16_t ) keyName[i] << ( 48 - 16 * i ); }
+    ref.offset = _arena.size();
+
+    HFSPlusCatalogKey key;
+    key.parentID = parentID;
+    key.nodeName.length = keyName.size();
+    key.keyLength = sizeof( key ) - sizeof( key.keyLength ) + sizeof( UniChar ) * keyName.size();
+    append( &key, sizeof( key ) );
+    append( keyName );
+    append( rec, recSize );
+    append( recName );
+
+    ref.size = _arena.size() - ref.offset;
+    _refs.push_back( ref );
+}
+
+const UniChar * FlatCatalog::nameOf( const Ref & ref ) const
+{ return ( const UniChar * ) ( _arena.data() + ref.offset + sizeof( HFSPlusCatalogKey ) ); }
+
+bool FlatCatalog::less( const Ref & left, const Ref & right ) const
+{
+    if( left.prefix != right.prefix ) { return left.prefix < right.prefix; }
+    const UniChar * ours = nameOf( left ), * theirs = nameOf( right );
+    size_t len = std::min( left.nameLen, right.nameLen );
+    for( size_t i = 0; i < len; ++i )
+    {
+        uint16_t our = ours[i], their = theirs[i];
+        if( our != their ) { return our < their; }
+    }
+    return left.nameLen < right.nameLen;
+}
+
+void FlatCatalog::sort()
+{
+    // a stable LSD radix sort on parentID, 16 bits at a time
+    std::vector<Ref> sorted( _refs.size() );
+    for( unsigned shift = 0; shift < 32; shift += 16 )
+    {
+        std::vector<size_t> start( 1 << 16, 0 );
+        for( auto & ref : _refs ) { ++start[( ref.parent >> shift ) & 0xffff]; }
+        size_t sum = 0;
+        for( auto & bucket : start ) { std::swap( bucket, sum ); sum += bucket; }
+        for( auto & ref : _refs ) { sorted[start[( ref.parent >> shift ) & 0xffff]++] = ref; }
+        std::swap( _refs, sorted );
+    }
+
+    // then the names of each parent's children; stable, so that the first of equals comes first
+    auto less = [this]( const Ref & left, const Ref & right ) { return this->less( left, right ); };
+    for( auto run = _refs.begin(); run != _refs.end(); )
+    {
+        uint32_t parent = run->parent;
+        auto past = std::find_if( run, _refs.end(), [parent]( const Ref & ref ) { return ref.parent != parent; } );
+        std::stable_sort( run, past, less );
+        run = past;
+    }
+
+    auto same = [&less]( const Ref & left, const Ref & right )
+    { return left.parent == right.parent && !less( left, right ) && !less( right, left ); };
+    _refs.erase( std::unique( _refs.begin(), _refs.end(), same ), _refs.end() );
+
+    _items.reserve( _refs.size() );
+    for( auto & ref : _refs ) { _items.emplace_back( _arena.data() + ref.offset, ref.size ); }
+    std::vector<Ref>().swap( _refs );
+}
+
+void FlatCatalog::clear()
+{
+    std::vector<Item>().swap( _items );
+    std::vector<Ref>().swap( _refs );
+    std::vector<char>().swap( _arena );
+}
+
+FlatCatalog::Key FlatCatalog::Item::key() const
+{
+    Key key;
+    memcpy( &key.data, at, sizeof( key.data ) );
+    const UniChar * name = ( const UniChar * ) ( at + sizeof( key.data ) );
+    key.name.assign( name, name + key.data.nodeName.length );
+    return key;
+}
+
 void BTHeaderRec::tuneForCatalog()
 {
     keyCompareType = BTreeKCType::KCBinaryCompare; // clear for extents overflow
@@ -161,9 +304,9 @@ void HFSPlusVolumeBuilder::setBlockSize( blksize_t blkSz )
     extentTree.header.clumpSize = blkSz;
 }
 
-void HFSPlusVolumeBuilder::onEntry( Entry * entry, Ptr<Record> dirEntRec, HFSPlusCatalogEntry & dirEnt, CNID nodeId )
+void HFSPlusVolumeBuilder::onEntry( Entry * entry, HFSPlusCatalogEntry & dirEnt, size_t dirEntSize, CNID nodeId )
 {
-    CNID parentId = entry->parent ? renum( entry->parent ) : kHFSRootParentID;
+    CNID parentId = entry->parent ? renum( entry->parent ) : ( CNID ) kHFSRootParentID;
 
     auto name = entry->decoded;
     decompo( name );
@@ -172,29 +315,14 @@ void HFSPlusVolumeBuilder::onEntry( Entry * entry, Ptr<Record> dirEntRec, HFSPlu
 
     // std::wcout << name << std::endl;
 
-    HFSPlusCatalogKey dirEntKey;
-    dirEntKey.parentID = parentId;
+    catalog.add( parentId, name, &dirEnt, dirEntSize, Unicode() ); // For file or folder records, this is the name
 
-    NamedRecord<HFSPlusCatalogKey> entryKeyRec( dirEntKey, name ); // For file or folder records, this is the name
-    entryKeyRec.data.keyLength = entryKeyRec.size() - sizeof( entryKeyRec.data.keyLength );
-    catalog.insert( std::make_pair( entryKeyRec, dirEntRec ) );
-
-    HFSPlusCatalogKey threadKey;
     HFSPlusCatalogThread thread( entry->isDir() );
-    threadKey.parentID = nodeId; //  For thread records, this is the CNID of the file or folder itself.
-
-    NamedRecord<HFSPlusCatalogKey> threadKeyRec( threadKey ); //  For thread records, this is the empty string.
-    threadKeyRec.data.keyLength = threadKeyRec.size() - sizeof( threadKeyRec.data.keyLength );
     thread.parentID = parentId; // The CNID of the parent of the file or folder
+    thread.nodeName.length = name.size();
 
-    Ptr<Record> threadRec = New<NamedRecord<HFSPlusCatalogThread>>( thread, name ); // generic
-    catalog.insert( std::make_pair( threadKeyRec, threadRec ) );
-}
-
-void HFSPlusVolumeBuilder::onEntry( Entry * entry, Ptr<Record> dirEntRec, HFSPlusCatalogEntry & dirEnt )
-{
-    CNID nodeId = renum( entry );
-    onEntry( entry, dirEntRec, dirEnt, nodeId );
+    //  For thread records, this is the CNID of the file or folder itself, and the empty string.
+    catalog.add( nodeId, Unicode(), &thread, sizeof( thread ), name );
 }
 
 HFSPlusExtentRecord * HFSPlusVolumeBuilder::onOverflow( CNID fileId, blkcnt_t blk )
@@ -210,7 +338,9 @@ HFSPlusExtentRecord * HFSPlusVolumeBuilder::onOverflow( CNID fileId, blkcnt_t bl
 
 void HFSPlusVolumeBuilder::compactTrees()
 {
+    catalog.sort();
     catalogTree.compactBTree( catalog );
+    catalog.clear();
     extentTree.compactBTree( overflow );
 }
 
@@ -266,40 +396,20 @@ void HFPlusOut::masterReserved( const Original & tree,
     else { printf( "Master offset %ld\n", outPlanner.offset() ); abort(); }
 }
 
-ino_t TopUnused( const std::set<ino_t> & top )
-{
-    ino_t candy = ~( ino_t )0;
-    auto itr = top.rbegin();
-    while( candy <= *itr )
-    {
-        if( candy == *itr )
-        { candy = ( *itr ) - 1; }
-        itr++;
-    }
-    return candy;
-}
-
 void HFPlusOut::masterComplete( const Original & tree,
                                 Planner & outPlanner, Planner & tmpPlanner,
                                 const Colonies & srcToTrg )
 {
     auto blkSz = blockSize();
-    CNID iroot = tree.fsRoot->stat.st_ino;
-    std::set<ino_t> inodeIds;
-    _vb.renum = [iroot, &inodeIds]( Entry * entry )
+    // source inode numbers are used as CNIDs unless invalid or colliding
+    _jam = New<InodeJam>( kHFSFirstUserCatalogNodeID, ~( CNID ) 0 );
+    if( _inode_map.size() ) { _jam->load( _inode_map.c_str() ); }
+    _jam->pin( tree.fsRoot.get(), kHFSRootFolderID );
+    _jam->assign( tree.pathTable, tree.fileTable );
+    auto jam = _jam;
+    _vb.renum = [jam]( Entry * entry ) -> CNID
     {
-        // TODO consider the zero (root parent) case;
-        // TODO introduce a substitution map
-        // TODO start considering st_dev
-        CNID ino;
-        if( entry == nullptr ) { ino = kHFSRootParentID; }
-        else
-        {
-            ino = entry->stat.st_ino;
-            if( ino == iroot ) { ino = kHFSRootFolderID; }
-            else { inodeIds.insert( ino ); }
-        }
-        return ino;
+        return entry ? jam->of( entry ) : ( InodeJam::FileId ) kHFSRootParentID;
     };
     _vb.decompo = [this]( Unicode & name )
     {
@@ -322,16 +432,16 @@ void HFPlusOut::masterComplete( const Original & tree,
     {
         PathEntry * pathEntry = *eItr++;
         auto entries = pathEntry->entries.size();
-        auto dirEntRec = New<NamedRecord<HFSPlusCatalogFolder>>( HFSPlusCatalogFolder( entries ) ); // move-in
-        dirEntRec->data.setSubFolderCount( subFolderCount[pathEntry].count );
-        _vb.onEntry( pathEntry, dirEntRec, dirEntRec->data );
+        HFSPlusCatalogFolder folder( entries );
+        folder.setSubFolderCount( subFolderCount[pathEntry].count );
+        _vb.onEntry( pathEntry, folder );
         subFolderCount[pathEntry->parent].count++;
     }
     for( FileEntry * fileEntry : tree.fileTable )
     {
-        auto dirEntRec = New<NamedRecord<HFSPlusCatalogFile>>( HFSPlusCatalogFile() ); // move-in
+        HFSPlusCatalogFile file;
         CNID fileId = _vb.renum( fileEntry ); // onEntry overloaded so that we didn't do it twice
-        HFSPlusForkData & dataFork = dirEntRec->data.dataFork;
+        HFSPlusForkData & dataFork = file.dataFork;
         off64_t length = fileEntry->stat.st_size;
         dataFork.logicalSize = length;
         dataFork.clumpSize = blkSz;
@@ -340,22 +450,20 @@ void HFPlusOut::masterComplete( const Original & tree,
         size_t extentNo = 0;
         blkcnt_t blk = 0;
         HFSPlusExtentDescriptor * pExt = nullptr;
-        for( const Extent & xt : tree.layout.at( fileEntry ) ) // must be charted at this point!
+        // must be charted at this point! the runs are in target dev coordinates
+        for( const Range & run : srcToTrg.translate( tree.layout.at( fileEntry ) ) )
         {
             if( extentNo == desc->size() )
             {
                 desc = _vb.onOverflow( fileId, blk );
                 extentNo = 0;
             }
-            // the offset here is in source dev coordinates; adjust...
-            off64_t offset = srcToTrg.withinDisk( xt );
-            // the offset here is in target dev coordinates
-            blkcnt_t extentLba = offset / blkSz;
-            blkcnt_t lengthLba = roundUp( xt.length, blkSz ) / blkSz;
+            blkcnt_t extentLba = run.offset / blkSz;
+            blkcnt_t lengthLba = roundUp( run.length, blkSz ) / blkSz;
 
             // we are doing the job of DeepLook here. move out! (or don't do,
             // doesn't seem to cause the problem w/ Invalid extent entry...)
-            // printf( "Read extent: %lu %lx+%lx\n", extentNo, offset, xt.length );
+            // printf( "Read extent: %lu %lx+%lx\n", extentNo, run.offset, run.length );
             if( pExt && ( ( pExt->startBlock + pExt->blockCount ) == extentLba ) )
             {
                 pExt->blockCount = pExt->blockCount + lengthLba; // FIXME pExt->extend( lengthLba );
@@ -371,7 +479,7 @@ void HFPlusOut::masterComplete( const Original & tree,
         dataFork.totalBlocks = blk;
 
         // what's interesting is that the total extent count isn't saved anywhere
-        _vb.onEntry( fileEntry, dirEntRec, dirEntRec->data, fileId );
+        _vb.onEntry( fileEntry, file, fileId );
     }
     // compute donut holes. add their extents into the bad block file => overflow
 
@@ -392,7 +500,7 @@ void HFPlusOut::masterComplete( const Original & tree,
     // blkcnt_t totalBlks = totalBlks * blkBits / ( blkBits - 1 )
     blkcnt_t blks = ( outPlanner.offset() << 3 ) / ( ( blkSz << 3 ) - 1 ) + 2;
     printf( "Writing the allocation bitmap (%lx blks)\n", blks );
-    Ptr<BitsMedium> deviceOne = New<BitsMedium>( true, 1 << 16, blks );
+    Ptr<BitsMedium> deviceOne = New<BitsMedium>( 1 << 16, blks );
     Extent allobits( 0, roundUp( deviceOne->byteCount() ), deviceOne );
     Extent tmpAlloc = tmpPlanner.wrapToGo( tmpPlanner.append( allobits ) );
     printf( "Temporary extent: %lx+%lx\n", tmpAlloc.offset, tmpAlloc.length );
@@ -436,15 +544,16 @@ void HFPlusOut::masterComplete( const Original & tree,
     _vol.writeCount = _vol.modifyDate;
     _vol.fileCount = tree.fileTable.size();
     _vol.folderCount = tree.pathTable.size() - 1;
-    _vol.nextCatalogID = TopUnused( inodeIds );
+    _vol.nextCatalogID = _jam->next();
+    if( _inode_map.size() ) { _jam->save( _inode_map.c_str() ); }
 
     if( 0 )
     {
-        for( auto & cataPair : _vb.catalog )
+        for( auto & cataNode : _vb.catalogTree.nodeList )
         {
-            printf( "C sizeof: key=%lu=%u val=%lu\n",
-                    cataPair.first.size(), ( uint16_t ) cataPair.first.data.keyLength, // NR
-                    cataPair.second->size() ); // Ptr<NR>
+            printf( "C node: kind=%d height=%u records=%u used=%lu\n",
+                    ( int ) cataNode->desc.kind, ( uint8_t ) cataNode->desc.height, // packed or not
+                    ( uint16_t ) cataNode->desc.numRecords, cataNode->size() );
         }
         for( auto & overPair : _vb.overflow )
         {
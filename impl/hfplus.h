@@ -17,6 +17,7 @@
 #include "impl/source.h"
 #include "impl/volume.h"
 #include "impl/master.h"
+#include "impl/inodes.h"
 
 namespace HP
 {
@@ -664,10 +665,14 @@ typedef zero BTUserDataRec[128];
 
 typedef UInt32 BTIndexPointer;
 
+struct NodeSpec;
+
 struct Record
 {
     virtual size_t size() const = 0;
     virtual ExtentList asExtentList() const = 0;
+    /// Add the record to a node; by default, as the extents of asExtentList().
+    virtual void addTo( NodeSpec & node ) const;
     virtual ~Record() = default;
 };
 
@@ -740,6 +745,8 @@ template<typename N> struct NamedRecord : public Record
                  TempExtent( name.data(), nameSize() ) };
     }
 
+    void addTo( NodeSpec & node ) const override;
+
 private:
     void setNameLen()
     {
@@ -749,18 +756,25 @@ private:
     }
 };
 
+/// A B-tree node under construction. A node is either a list of record extents,
+/// resolved on commit (the header and map nodes, referencing live structures),
+/// or a packed node-sized buffer the records are copied into as they are added,
+/// with the offset table written in place (the leaf and index nodes).
 struct NodeSpec
 {
     size_t offset = 0;
     BTNodeDescriptor desc;
     std::list<Extent> recs;
     std::vector<UInt16> offsets;
+    std::vector<char> packed; ///< the node contents if packed; the descriptor is copied in by writeTo()
 
     inline NodeSpec() { addRecord( TempExtent( desc ) ); markRecord(); }
     NodeSpec( BTNodeKind kind );
     NodeSpec( BTNodeKind kind, uint8_t level );
+    /// Create a packed node of the provided capacity.
+    NodeSpec( BTNodeKind kind, uint8_t level, blksize_t capacity );
 
-    inline size_t offSize() const { return sizeof( NodeRecOff ) * offsets.size(); }
+    inline size_t offSize() const { return sizeof( NodeRecOff ) * ( uint16_t ) ( desc.numRecords + 1 ); }
     inline size_t size() const { return offset + offSize(); }
     size_t freeSpace( blksize_t capacity, bool gross = false ) const;
     bool fitsIn( blksize_t capacity, size_t recordSize ) const;
@@ -768,6 +782,7 @@ struct NodeSpec
 
     void addRecord( const Extent & one );
     void addRecord( const ExtentList & xl );
+    void addRecord( const void * ptr, size_t size );
     void addRecord( const Record & record );
     void addRecord( Ptr<Record> record );
     template<typename K, typename V>
@@ -777,15 +792,22 @@ struct NodeSpec
         addRecord( mapping.second );
     }
     // whitelist types directly to avoid template specialization ambiguity. bad!
-    void addRecord( const HFSPlusExtentKey & t ) { addRecord( TempExtent( t ) ); }
-    void addRecord( const HFSPlusCatalogKey & t ) { addRecord( TempExtent( t ) ); }
-    void addRecord( const HFSPlusExtentRecord & t ) { addRecord( TempExtent( t ) ); }
-    void addRecord( const UInt32 & pointer ) { addRecord( TempExtent( pointer ) ); }
+    void addRecord( const HFSPlusExtentKey & t ) { addRecord( &t, sizeof( t ) ); }
+    void addRecord( const HFSPlusCatalogKey & t ) { addRecord( &t, sizeof( t ) ); }
+    void addRecord( const HFSPlusExtentRecord & t ) { addRecord( &t, sizeof( t ) ); }
+    void addRecord( const UInt32 & pointer ) { addRecord( &pointer, sizeof( pointer ) ); }
     void markRecord();
 
-    void writeTo( IAppend & out, blksize_t capacity ) const;
+    void writeTo( IAppend & out, blksize_t capacity );
 };
 
+template<typename N>
+void NamedRecord<N>::addTo( NodeSpec & node ) const
+{
+    node.addRecord( &data, sizeof( data ) );
+    node.addRecord( name.data(), nameSize() );
+}
+
 // BTMapRec
 // The remaining space in the header node is occupied by a third record, the map record.
 // It is a bitmap that indicates which nodes in the B-tree are used and which are free.
@@ -1009,6 +1031,70 @@ size_t RecordSize( const std::pair<K, V> & mapping )
            RecordSize( mapping.second );
 }
 
+/// Return the key a record is indexed by in the level above.
+template<typename K, typename V>
+const K & IndexKey( const std::pair<K, V> & mapping ) { return mapping.first; }
+
+/// A flat catalog: leaf records are appended back to back into one arena in
+/// their on-disk layout (key, key name, record, record name) and sorted once
+/// when complete, by an index of (parentID, name) references.
+/// The order is that of NamedRecord<HFSPlusCatalogKey>: parentID, then the
+/// binary (kHFSBinaryCompare) name; of equal keys, the first added wins.
+/// The records are copied into packed tree nodes; the arena can be released then.
+struct FlatCatalog
+{
+    typedef NamedRecord<HFSPlusCatalogKey> Key;
+
+    /// A leaf record in the arena; valid after sort().
+    struct Item : public Record
+    {
+        const char * at;
+        size_t length;
+
+        Item( const char * ptr, size_t size ) : at( ptr ), length( size ) {}
+        size_t size() const override { return length; }
+        ExtentList asExtentList() const override { return { TempExtent( at, length ) }; }
+        void addTo( NodeSpec & node ) const override { node.addRecord( at, length ); }
+        Key key() const;
+    };
+
+    /// Append a record under (parentID, keyName) with recName following it.
+    /// Thread records have an empty key name; file and folder records have no record name.
+    void add( CNID parentID, const Unicode & keyName, const void * rec, size_t recSize, const Unicode & recName );
+
+    /// Sort the records by key. No records can be added afterwards.
+    void sort();
+
+    /// Release the records.
+    void clear();
+
+    size_t size() const { return _items.size(); }
+    std::vector<Item>::const_iterator begin() const { return _items.begin(); }
+    std::vector<Item>::const_iterator end() const { return _items.end(); }
+
+private:
+    /// A sort key: the parent, a big-endian prefix of the name and the location of the record.
+    struct Ref
+    {
+        uint32_t parent;
+        uint32_t nameLen;
+        uint64_t prefix; ///< the first 4 code units; zero-padded
+        size_t offset;
+        size_t size;
+    };
+
+    void append( const void * ptr, size_t size );
+    void append( const Unicode & name );
+    const UniChar * nameOf( const Ref & ref ) const;
+    bool less( const Ref & left, const Ref & right ) const;
+
+    std::vector<char> _arena;
+    std::vector<Ref> _refs;
+    std::vector<Item> _items;
+};
+
+inline FlatCatalog::Key IndexKey( const FlatCatalog::Item & item ) { return item.key(); }
+
 template<typename K>
 struct TreeBuilder
 {
@@ -1031,10 +1117,10 @@ struct TreeBuilder
         nodeList.push_back( headerRec );
     }
 
-    template<typename V>
-    void compactLevel( IndexMap & indices, const std::map<K, V> & dataMap, BTNodeKind kind, size_t level )
+    template<typename M>
+    void compactLevel( IndexMap & indices, const M & dataMap, BTNodeKind kind, size_t level )
     {
-        Ptr<NodeSpec> next = New<NodeSpec>( kind, level );
+        Ptr<NodeSpec> next = New<NodeSpec>( kind, level, header.nodeSize );
         for( auto & dataPair : dataMap )
         {
             auto recLength = RecordSize( dataPair );
@@ -1043,13 +1129,13 @@ struct TreeBuilder
                 auto pastIndex = nodeCount();
                 nodeList.push_back( next );
                 Ptr<NodeSpec> prev = nodeList.back();
-                next = New<NodeSpec>( kind, level );
+                next = New<NodeSpec>( kind, level, header.nodeSize );
                 prev->desc.fLink = pastIndex + 1;
                 next->desc.bLink = pastIndex;
             }
             if( !next->count() ) // expose key
             {
-                indices[dataPair.first] = nodeCount();
+                indices[IndexKey( dataPair )] = nodeCount();
             }
             auto oldOff = next->offset;
             next->addRecord( dataPair );
@@ -1065,8 +1151,8 @@ struct TreeBuilder
         nodeList.push_back( next );
     }
 
-    template<typename V>
-    void compactBTree( const std::map<K, V> & dataMap )
+    template<typename M>
+    void compactBTree( const M & dataMap )
     {
         IndexMap indices;
 
@@ -1109,7 +1195,7 @@ struct TreeBuilder
         auto fs = headerRec->freeSpace( 256 ); // "gross" free space
         if( fs != 0 ) { printf( "Corrupt header record: %lx (-%lx)\n", fs, -fs ); abort(); }
 
-        Ptr<BitsMedium> fillMed = New<BitsMedium>( false );
+        Ptr<BitsMedium> fillMed = New<BitsMedium>();
         auto mapNode = headerRec;
         ssize_t done = 0;
 
@@ -1157,8 +1243,8 @@ struct HFSPlusVolumeBuilder
     Decompo decompo;
     blksize_t _blk_sz;
 
-    typedef NamedRecord<HFSPlusCatalogKey> NamedCatalogKey;
-    std::map<NamedCatalogKey, Ptr<Record>> catalog; // keeps shared pointers to records
+    typedef FlatCatalog::Key NamedCatalogKey;
+    FlatCatalog catalog; // released once packed into the tree
     std::map<HFSPlusExtentKey, HFSPlusExtentRecord> overflow; // directly comparable, no indirection
 
     TreeBuilder<NamedCatalogKey> catalogTree;
@@ -1166,8 +1252,11 @@ struct HFSPlusVolumeBuilder
 
     HFSPlusVolumeBuilder();
     void setBlockSize( blksize_t blkSz );
-    void onEntry( Entry * entry, Ptr<Record> dirEntRec, HFSPlusCatalogEntry & dirEnt, CNID nodeId );
-    void onEntry( Entry * entry, Ptr<Record> dirEntRec, HFSPlusCatalogEntry & dirEnt );
+    void onEntry( Entry * entry, HFSPlusCatalogEntry & dirEnt, size_t dirEntSize, CNID nodeId );
+    template<typename R>
+    void onEntry( Entry * entry, R & dirEnt, CNID nodeId ) { onEntry( entry, dirEnt, sizeof( R ), nodeId ); }
+    template<typename R>
+    void onEntry( Entry * entry, R & dirEnt ) { onEntry( entry, dirEnt, sizeof( R ), renum( entry ) ); }
     HFSPlusExtentRecord * onOverflow( CNID fileId, blkcnt_t blk );
     void compactTrees();
 };
@@ -1180,6 +1269,10 @@ struct HFPlusOut : public Volume, public Hybrid
     void setBlockSize( blksize_t blkSz ) override;
     void setLabels( const char * system, const char * volume ) override;
 
+    /// Remember the CNIDs assigned to source files in a file, to keep them
+    /// stable across rebuilds (see InodeJam). Empty path: don't remember.
+    void setInodeMap( const char * path ) { _inode_map = path ? path : ""; }
+
 protected:
     Colonies plan( const Original & tree, Planner & outPlanner, Planner & tmpPlanner ) override;
 
@@ -1192,6 +1285,8 @@ private: // impl
 
 private: // data
     std::string _vol_label;
+    std::string _inode_map;
+    Ptr<InodeJam> _jam;
     MBR _mbr;
     HFSPlusVolumeHeader _vol;
     HFSPlusVolumeBuilder _vb; // inline?
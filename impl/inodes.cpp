@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "inodes.h"
+
+namespace
+{
+
+/// A stable 64-bit mix (SplitMix64 finalizer); std::hash isn't stable across builds.
+uint64_t Mix( uint64_t x )
+{
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+}
+
+}
+
+InodeJam::Key InodeJam::KeyOf( const Entry * entry )
+{
+    return { ( uint64_t ) entry->stat.st_dev, ( uint64_t ) entry->stat.st_ino, ( uint64_t ) entry->generation };
+}
+
+void InodeJam::load( const char * path )
+{
+    FILE * in = fopen( path, "r" );
+    if( !in )
+    {
+        if( errno != ENOENT ) { perror( path ); }
+        return;
+    }
+    Key key;
+    unsigned long id;
+    unsigned age;
+    while( fscanf( in, "%lx %lx %lx %lx %u", &key.dev, &key.ino, &key.gen, &id, &age ) == 5 )
+    {
+        if( id < _first || id > _last ) { continue; }
+        _past[key] = { ( FileId ) id, age };
+        _taken.insert( id );
+    }
+    fclose( in );
+    printf( "Inode map: %lu ids remembered\n", _past.size() );
+}
+
+void InodeJam::save( const char * path ) const
+{
+    std::string temp = path;
+    temp.append( ".new" );
+    FILE * out = fopen( temp.c_str(), "w" );
+    if( !out ) { perror( temp.c_str() ); return; }
+
+    for( auto & live : _live )
+    {
+        const Key & key = live.first;
+        fprintf( out, "%lx %lx %lx %x 0\n", key.dev, key.ino, key.gen, live.second );
+    }
+    for( auto & past : _past )
+    {
+        if( _live.count( past.first ) || past.second.age + 1 >= kMaxAge ) { continue; }
+        const Key & key = past.first;
+        fprintf( out, "%lx %lx %lx %x %u\n", key.dev, key.ino, key.gen, past.second.id, past.second.age + 1 );
+    }
+
+    if( fflush( out ) || fsync( fileno( out ) ) < 0 ) { perror( temp.c_str() ); }
+    fclose( out );
+    if( rename( temp.c_str(), path ) < 0 ) { perror( path ); }
+}
+
+void InodeJam::pin( const Entry * entry, FileId id ) { _ids[entry] = id; }
+
+bool InodeJam::isFree( FileId id ) const
+{
+    return id >= _first && id <= _last && !_taken.count( id );
+}
+
+void InodeJam::claim( const Entry * entry, const Key & key, FileId id )
+{
+    _ids[entry] = id;
+    _taken.insert( id );
+    _live.insert( std::make_pair( key, id ) ); // the first of hard links wins
+}
+
+void InodeJam::assign( const Index<PathEntry> & folders, const Index<FileEntry> & files )
+{
+    typedef std::pair<Key, const Entry *> Item;
+    std::vector<Item> items;
+    items.reserve( folders.size() + files.size() );
+    for( const Entry * entry : folders ) { if( !_ids.count( entry ) ) { items.emplace_back( KeyOf( entry ), entry ); } }
+    for( const Entry * entry : files ) { if( !_ids.count( entry ) ) { items.emplace_back( KeyOf( entry ), entry ); } }
+
+    // the identity order; hard links (equal keys) are ordered by path
+    std::sort( items.begin(), items.end(), []( const Item & left, const Item & right )
+    {
+        if( left.first < right.first ) { return true; }
+        if( right.first < left.first ) { return false; }
+        return left.second->absPath < right.second->absPath;
+    } );
+
+    // 1. remembered ids
+    std::vector<Item> rest;
+    std::set<FileId> claimed;
+    for( auto & item : items )
+    {
+        auto itr = _past.find( item.first );
+        if( itr != _past.end() && !_live.count( item.first ) && claimed.insert( itr->second.id ).second )
+        { claim( item.second, item.first, itr->second.id ); }
+        else { rest.push_back( item ); }
+    }
+
+    // 2. inode numbers
+    items.clear();
+    for( auto & item : rest )
+    {
+        uint64_t ino = item.first.ino;
+        if( ino == ( FileId ) ino && isFree( ino ) ) { claim( item.second, item.first, ino ); }
+        else { items.push_back( item ); }
+    }
+
+    // 3. hashed identities
+    uint64_t span = ( uint64_t ) _last - _first + 1;
+    for( auto & item : items )
+    {
+        const Key & key = item.first;
+        uint64_t probe = Mix( key.dev ^ Mix( key.ino ^ Mix( key.gen ) ) ) % span;
+        uint64_t tries = 0;
+        while( !isFree( _first + probe ) )
+        {
+            probe = ( probe + 1 ) % span;
+            if( ++tries == span ) { printf( "Out of file ids\n" ); abort(); }
+        }
+        claim( item.second, key, _first + probe );
+    }
+}
+
+InodeJam::FileId InodeJam::next() const
+{
+    if( _taken.empty() ) { return _first; }
+    FileId top = *_taken.rbegin();
+    if( top < _last ) { return top + 1; }
+    // the range is exhausted at the top; return the highest gap
+    for( FileId id = _last; id > _first; --id ) { if( isFree( id ) ) { return id; } }
+    return _last;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef INODES_H
+#define INODES_H
+
+#include "wrapper.h"
+
+#include "impl/source.h"
+
+/// "Inode jamming": a stable assignment of target file ids (such as HFS+ CNIDs)
+/// to source entries. The host caches file contents, thumbnails and search
+/// indices per file id, so the same file should get the same id every time
+/// the volume is rebuilt, even if other files have come and gone.
+///
+/// An entry is identified by (st_dev, st_ino, generation). The assignment is:
+/// 1. the id remembered from the previous build, if any (see load());
+/// 2. otherwise, st_ino itself, if valid and not taken;
+/// 3. otherwise, a hash of the identity, probed linearly until a free id.
+/// Within steps 2 and 3, entries are processed in the identity order, so the
+/// outcome doesn't depend on the directory traversal order.
+///
+/// Hard links of one inode get one id each: an HFS+ catalog entry needs a CNID of
+/// its own (shared ids would take indirect node files). The first link by path
+/// keeps the remembered id.
+///
+/// Ids of files that have disappeared stay reserved for a few builds, so that
+/// a new file doesn't inherit the cached identity of a deleted one.
+struct InodeJam
+{
+    typedef uint32_t FileId;
+
+    /// The identity of a source entry that survives a rebuild.
+    struct Key
+    {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t gen;
+
+        inline bool operator<( const Key & other ) const
+        {
+            return dev != other.dev ? dev < other.dev
+                   : ino != other.ino ? ino < other.ino
+                   : gen < other.gen;
+        }
+    };
+
+    /// Create an assignment of ids in the [first, last] range.
+    InodeJam( FileId first, FileId last ) : _first( first ), _last( last ) {}
+
+    /// Load the assignment of the previous build. A missing file is not an error.
+    void load( const char * path );
+
+    /// Save the current assignment (and the recently retired ids) for the next build.
+    void save( const char * path ) const;
+
+    /// Assign a reserved id (outside the range) to an entry, e.g. to the root folder.
+    void pin( const Entry * entry, FileId id );
+
+    /// Assign ids to all the folders and files of the tree, except for the pinned ones.
+    void assign( const Index<PathEntry> & folders, const Index<FileEntry> & files );
+
+    /// Return the id assigned to an entry.
+    FileId of( const Entry * entry ) const { return _ids.at( entry ); }
+
+    /// Return an id above all the assigned (and reserved) ones, if possible.
+    FileId next() const;
+
+    /// Return the identity of an entry.
+    static Key KeyOf( const Entry * entry );
+
+private:
+    bool isFree( FileId id ) const;
+    void claim( const Entry * entry, const Key & key, FileId id );
+
+    struct Memo
+    {
+        FileId id;
+        unsigned age; ///< builds since the entry was last seen
+    };
+
+    static constexpr const unsigned kMaxAge = 8;
+
+    FileId _first, _last;
+    std::map<Key, Memo> _past;            ///< loaded from the previous build
+    std::map<Key, FileId> _live;          ///< assigned in this build
+    std::set<FileId> _taken;              ///< assigned or reserved
+    std::map<const Entry *, FileId> _ids;
+};
+
+#endif // INODES_H
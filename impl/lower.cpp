@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "lower.h"
+
+#include <sstream>
+
+namespace
+{
+
+/// Undo the octal escapes (\040 for a space etc.) of a mount table field.
+std::string Unescape( const std::string & field )
+{
+    std::string out;
+    for( size_t pos = 0; pos < field.size(); ++pos )
+    {
+        if( field[pos] == '\\' && pos + 3 < field.size() && isdigit( field[pos + 1] ) )
+        {
+            out.push_back( ( char ) strtol( field.substr( pos + 1, 3 ).c_str(), nullptr, 8 ) );
+            pos += 3;
+        }
+        else { out.push_back( field[pos] ); }
+    }
+    return out;
+}
+
+/// Whether the path starts with the prefix as a whole path component.
+bool HasPrefix( const std::string & path, const std::string & prefix )
+{
+    return !path.compare( 0, prefix.size(), prefix )
+           && ( path.size() == prefix.size() || path[prefix.size()] == '/' || prefix == "/" );
+}
+
+}
+
+void LowerLocator::scanMounts( const char * mountInfo )
+{
+    FILE * in = fopen( mountInfo, "r" );
+    if( !in ) { perror( mountInfo ); return; }
+
+    char * line = nullptr;
+    size_t size = 0;
+    while( getline( &line, &size, in ) > 0 )
+    {
+        // id parent major:minor root mountpoint options [optional...] - fstype source superoptions
+        std::istringstream fields( line );
+        std::string id, parent, device, root, point, options, field, type, source;
+        fields >> id >> parent >> device >> root >> point >> options;
+        while( fields >> field && field != "-" ) {}
+        fields >> type >> source;
+
+        unsigned major, minor;
+        if( sscanf( device.c_str(), "%u:%u", &major, &minor ) != 2 ) { continue; }
+        bool fuse = type == "fuse" || !type.compare( 0, 5, "fuse." );
+        bool sdcardfs = type == "sdcardfs" || type == "esdfs";
+        if( !fuse && !sdcardfs ) { continue; }
+
+        _stacked.insert( makedev( major, minor ) );
+        point = Unescape( point );
+        if( sdcardfs && !_prefixes.count( point ) ) // configured prefixes take precedence
+        {
+            root = Unescape( root );
+            _prefixes[point] = Unescape( source ) + ( root == "/" ? "" : root );
+        }
+    }
+    free( line );
+    fclose( in );
+}
+
+Ptr<Medium> LowerLocator::lower( const Extent & source )
+{
+    int fd = source.medium->fd();
+    struct stat64 upSt;
+    if( fd < 0 || fstat64( fd, &upSt ) < 0 || !_stacked.count( upSt.st_dev ) ) { return nullptr; }
+
+    // the canonical upper path, as the mount table sees it
+    char link[PATH_MAX];
+    std::string proc = "/proc/self/fd/" + std::to_string( fd );
+    ssize_t len = readlink( proc.c_str(), link, sizeof( link ) - 1 );
+    if( len <= 0 ) { perror( proc.c_str() ); return nullptr; }
+    std::string upper( link, len );
+
+    const std::pair<const std::string, std::string> * best = nullptr;
+    for( auto & prefix : _prefixes )
+    {
+        if( HasPrefix( upper, prefix.first ) && ( !best || best->first.size() < prefix.first.size() ) )
+        { best = &prefix; }
+    }
+    if( !best )
+    {
+        if( _unmapped.insert( upSt.st_dev ).second )
+        {
+            printf( "No lower path for %s on the stacked device %u:%u\n",
+                    upper.c_str(), major( upSt.st_dev ), minor( upSt.st_dev ) );
+        }
+        return nullptr;
+    }
+
+    std::string path = best->second + upper.substr( best->first == "/" ? 0 : best->first.size() );
+    int lowFd = open( path.c_str(), O_RDONLY );
+    if( lowFd < 0 ) { perror( path.c_str() ); return nullptr; }
+    struct stat64 lowSt;
+    if( fstat64( lowFd, &lowSt ) < 0 || !S_ISREG( lowSt.st_mode ) || lowSt.st_size != upSt.st_size )
+    {
+        printf( "Lower file %s doesn't match %s\n", path.c_str(), upper.c_str() );
+        close( lowFd );
+        return nullptr;
+    }
+    return New<LowerMedium>( lowFd, lowSt, path );
+}
+
+ExtentList LowerLocator::resolve( const Extent & source )
+{
+    Ptr<Medium> medium = lower( source );
+    if( !medium ) { return _inner->resolve( source ); }
+
+    _uppers[medium] = source.medium;
+    return _inner->resolve( Extent( source.offset, source.length, medium ) );
+}
+
+void LowerLocator::review( Revise revise )
+{
+    _inner->review( [this, &revise]( const Extent & source, const ExtentList & fresh )
+    {
+        auto itr = _uppers.find( source.medium );
+        if( itr == _uppers.end() ) { revise( source, fresh ); }
+        else { revise( Extent( source.offset, source.length, itr->second ), fresh ); }
+    } );
+}
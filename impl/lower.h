@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef LOWER_H
+#define LOWER_H
+
+#include "wrapper.h"
+
+#include "impl/extent.h"
+
+/// A file of the lower filesystem standing in for a file of a stacked one.
+/// Owns the file descriptor; path() is the lower path (for the reports).
+struct LowerMedium : public FileMedium
+{
+    LowerMedium( int inFd, const struct stat64 & inSt, const std::string & path )
+        : FileMedium( inFd, inSt ), _path( path ) {}
+    ~LowerMedium() { close( _fd ); }
+    const char * path() const override { return _path.c_str(); }
+
+private:
+    std::string _path;
+};
+
+/// A locator decorator for stacked filesystems (FUSE, sdcardfs), where FIEMAP
+/// is unsupported or meaningless. A file found on a stacked filesystem is
+/// reopened on the lower one, and the decorated locator resolves the lower
+/// file instead; the upper names are still exposed.
+///
+/// The lower path is obtained by replacing the longest matching prefix of the
+/// upper path: the prefixes are configured with map() or learned from the
+/// mount table (an sdcardfs mount source is the lower folder). FUSE mounts
+/// are recognized but need a configured prefix, e.g. /storage/emulated to
+/// /data/media on Android.
+struct LowerLocator : public ILocator
+{
+    LowerLocator( Ptr<ILocator> inner ) : _inner( inner ) {}
+
+    /// Map the upper path prefix to the lower one.
+    void map( const char * upper, const char * lower ) { _prefixes[upper] = lower; }
+
+    /// Learn the stacked filesystems (and the sdcardfs prefixes) from the mount table.
+    void scanMounts( const char * mountInfo = "/proc/self/mountinfo" );
+
+    ExtentList resolve( const Extent & source ) override;
+
+    /// Review the decorated locator, presenting the upper files to the caller.
+    void review( Revise revise ) override;
+
+private:
+    /// Return the lower file standing in for the source, or null if none.
+    Ptr<Medium> lower( const Extent & source );
+
+    Ptr<ILocator> _inner;
+    std::map<std::string, std::string> _prefixes; ///< upper to lower path prefixes
+    std::set<dev_t> _stacked;                     ///< devices of the stacked filesystems
+    std::set<dev_t> _unmapped;                    ///< stacked devices already reported
+    std::map<Ptr<Medium>, Ptr<Medium>> _uppers; ///< lower to upper media (keeps the lower fds open)
+};
+
+#endif // LOWER_H
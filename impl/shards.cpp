@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "shards.h"
+
+void Shards::partition( const char * root, size_t count, Criterion by )
+{
+    _count = std::max<size_t>( count, 1 );
+    _owner.clear();
+
+    DIR * dir = opendir( root );
+    if( !dir ) { perror( root ); abort(); }
+
+    // (mtime, name) pairs sort by name alone if the mtime is kept zero
+    std::vector<std::pair<time_t, std::string>> tops;
+    struct dirent64 * ptr;
+    while( ( ptr = readdir64( dir ) ) )
+    {
+        if( !strcmp( ptr->d_name, "." ) || !strcmp( ptr->d_name, ".." ) ) { continue; }
+        struct stat64 st;
+        time_t key = 0;
+        if( by == ByDate && fstatat64( dirfd( dir ), ptr->d_name, &st, AT_SYMLINK_NOFOLLOW ) >= 0 )
+        { key = st.st_mtime; }
+        tops.emplace_back( key, ptr->d_name );
+    }
+    closedir( dir );
+
+    std::sort( tops.begin(), tops.end() );
+
+    // contiguous ranges: shard #k gets entries [k*n/K, (k+1)*n/K)
+    size_t total = tops.size();
+    for( size_t pos = 0; pos < total; ++pos )
+    {
+        _owner[tops[pos].second] = pos * _count / total;
+    }
+    printf( "Sharding %lu top-level entries %s into %lu volumes\n",
+            total, by == ByDate ? "by date" : "by name", _count );
+}
+
+size_t Shards::owner( const char * name ) const
+{
+    auto itr = _owner.find( name );
+    return itr == _owner.end() ? _count - 1 : itr->second;
+}
+
+std::string Shards::name( const char * common, size_t index ) const
+{
+    std::string out = common;
+    if( _count <= 1 ) { return out; }
+
+    std::string suffix = std::to_string( index );
+    if( common[0] != '/' ) { return out + suffix; } // device name
+
+    size_t base = out.rfind( '/' ) + 1;
+    size_t dot = out.rfind( '.' );
+    if( dot == std::string::npos || dot <= base ) { dot = out.size(); }
+    return out.insert( dot, "-" + suffix );
+}
+
+std::string Shards::pick( const char * list, size_t index, bool derive ) const
+{
+    if( !list ) { return std::string(); }
+
+    std::vector<std::string> items;
+    const char * start = list;
+    for( const char * end; ( end = strchr( start, ',' ) ); start = end + 1 )
+    { items.emplace_back( start, end ); }
+    items.emplace_back( start );
+
+    if( index < items.size() ) { return items[index]; }
+    return derive ? name( items.back().c_str(), index ) : std::string();
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include "wrapper.h"
+
+/// A partition of the top-level entries of a source folder into a few
+/// disjoint sets ("shards"), each of which becomes a separate target volume.
+/// Top-level entries are never split: a folder goes to exactly one shard.
+struct Shards
+{
+    /// The sort order of top-level entries before cutting them into shards.
+    enum Criterion
+    {
+        ByFolder = 0, ///< by name, e.g. [A-F] [G-M] [N-Z]
+        ByDate,       ///< by modification time, oldest first
+    };
+
+    /// Partition the top-level entries of the root folder into count
+    /// contiguous groups of (roughly) the same number of entries.
+    void partition( const char * root, size_t count, Criterion by );
+
+    /// Return the number of shards.
+    size_t size() const { return _count; }
+
+    /// Return the shard index the named top-level entry belongs to.
+    /// Entries that appeared after partition() go to the last shard.
+    size_t owner( const char * name ) const;
+
+    /// Derive a per-shard name from a common one: a device name ("virtualcd"
+    /// becomes "virtualcd0", "virtualcd1"...) or a file path ("/a/b.iso" becomes
+    /// "/a/b-0.iso", "/a/b-1.iso"...). A single shard keeps the common name.
+    std::string name( const char * common, size_t index ) const;
+
+    /// Pick the index-th element of a comma-separated list, e.g. the per-shard
+    /// temporary medium in "--tmp=/dev/block/zram1,/dev/block/zram2".
+    /// If derive is set, absent elements derive from the last one with name();
+    /// otherwise, an empty string is returned.
+    std::string pick( const char * list, size_t index, bool derive ) const;
+
+private:
+    size_t _count = 1;
+    std::map<std::string, size_t> _owner;
+};
+
+#endif // SHARDS_H
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "simd.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FSVIEW_SIMD_X86 1
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#define FSVIEW_SIMD_NEON 1
+#endif
+
+// SVE kernels are built for a function target, so that the rest of the binary
+// runs on any ARMv8; older toolchains only build them if SVE is the baseline.
+#if defined(__aarch64__) && !defined(FSVIEW_SIMD_SVE)
+#if defined(__ARM_FEATURE_SVE) || ( defined(__clang__) && __clang_major__ >= 17 ) \
+    || ( !defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 11 )
+#define FSVIEW_SIMD_SVE 1
+#endif
+#endif
+
+#if FSVIEW_SIMD_SVE
+#include <arm_sve.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SVE
+#define HWCAP_SVE ( 1 << 22 )
+#endif
+#ifdef __clang__
+#define FSVIEW_TARGET_SVE __attribute__( ( target( "sve" ) ) )
+#else
+#define FSVIEW_TARGET_SVE __attribute__( ( target( "+sve" ) ) )
+#endif
+#endif
+
+namespace
+{
+
+typedef void ( *SequenceFn )( uint32_t * out, size_t count, uint32_t start );
+typedef void ( *SplatFn )( void * out, uint8_t value, size_t size );
+
+/// Return the number of leading words (of count) to skip to reach an A-byte boundary.
+template <uintptr_t A>
+size_t Lead( const uint32_t * out, size_t count )
+{
+    return std::min<size_t>( count, ( ( A - ( uintptr_t ) out % A ) % A ) / sizeof( uint32_t ) );
+}
+
+/// Whether a sequence of count words at out is worth (and able to) bypass the cache.
+bool Streams( const uint32_t * out, size_t count )
+{
+    return count * sizeof( uint32_t ) >= Simd::STREAM_SZ && !( ( uintptr_t ) out % sizeof( uint32_t ) );
+}
+
+// the reference
+
+void SequenceScalar( uint32_t * out, size_t count, uint32_t start )
+{
+    for( size_t index = 0; index < count; ++index ) { out[index] = ++start; }
+}
+
+void SplatScalar( void * out, uint8_t value, size_t size ) { memset( out, value, size ); }
+
+#if FSVIEW_SIMD_X86
+
+// 01 00 00 00 02 00 00 00  03 00 00 00 04 00 00 00
+__attribute__( ( target( "sse2" ) ) )
+void SequenceSSE2( uint32_t * out, size_t count, uint32_t start )
+{
+    bool stream = Streams( out, count );
+    size_t lead = stream ? Lead<16>( out, count ) : 0;
+    SequenceScalar( out, lead, start );
+    out += lead; count -= lead; start += lead;
+
+    __m128i quad = _mm_add_epi32( _mm_set1_epi32( start ), _mm_setr_epi32( 1, 2, 3, 4 ) );
+    const __m128i incr = _mm_set1_epi32( 4 );
+    size_t body = count & ~( size_t ) 3;
+    if( stream )
+    {
+        for( size_t index = 0; index < body; index += 4, quad = _mm_add_epi32( quad, incr ) )
+        { _mm_stream_si128( ( __m128i * )( out + index ), quad ); }
+        _mm_sfence();
+    }
+    else
+    {
+        for( size_t index = 0; index < body; index += 4, quad = _mm_add_epi32( quad, incr ) )
+        { _mm_storeu_si128( ( __m128i * )( out + index ), quad ); }
+    }
+    SequenceScalar( out + body, count - body, start + body );
+}
+
+__attribute__( ( target( "sse2" ) ) )
+void SplatSSE2( void * out, uint8_t value, size_t size )
+{
+    if( size < Simd::STREAM_SZ ) { memset( out, value, size ); return; }
+    char * ptr = ( char * ) out;
+    size_t lead = ( 16 - ( uintptr_t ) ptr % 16 ) % 16;
+    memset( ptr, value, lead );
+    ptr += lead; size -= lead;
+
+    const __m128i fill = _mm_set1_epi8( ( char ) value );
+    size_t body = size & ~( size_t ) 15;
+    for( size_t index = 0; index < body; index += 16 ) { _mm_stream_si128( ( __m128i * )( ptr + index ), fill ); }
+    _mm_sfence();
+    memset( ptr + body, value, size - body );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+void SequenceAVX2( uint32_t * out, size_t count, uint32_t start )
+{
+    bool stream = Streams( out, count );
+    size_t lead = stream ? Lead<32>( out, count ) : 0;
+    SequenceScalar( out, lead, start );
+    out += lead; count -= lead; start += lead;
+
+    __m256i octa = _mm256_add_epi32( _mm256_set1_epi32( start ), _mm256_setr_epi32( 1, 2, 3, 4, 5, 6, 7, 8 ) );
+    const __m256i incr = _mm256_set1_epi32( 8 );
+    size_t body = count & ~( size_t ) 7;
+    if( stream )
+    {
+        for( size_t index = 0; index < body; index += 8, octa = _mm256_add_epi32( octa, incr ) )
+        { _mm256_stream_si256( ( __m256i * )( out + index ), octa ); }
+        _mm_sfence();
+    }
+    else
+    {
+        for( size_t index = 0; index < body; index += 8, octa = _mm256_add_epi32( octa, incr ) )
+        { _mm256_storeu_si256( ( __m256i * )( out + index ), octa ); }
+    }
+    SequenceScalar( out + body, count - body, start + body );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+void SplatAVX2( void * out, uint8_t value, size_t size )
+{
+    if( size < Simd::STREAM_SZ ) { memset( out, value, size ); return; }
+    char * ptr = ( char * ) out;
+    size_t lead = ( 32 - ( uintptr_t ) ptr % 32 ) % 32;
+    memset( ptr, value, lead );
+    ptr += lead; size -= lead;
+
+    const __m256i fill = _mm256_set1_epi8( ( char ) value );
+    size_t body = size & ~( size_t ) 31;
+    for( size_t index = 0; index < body; index += 32 ) { _mm256_stream_si256( ( __m256i * )( ptr + index ), fill ); }
+    _mm_sfence();
+    memset( ptr + body, value, size - body );
+}
+
+__attribute__( ( target( "avx512f" ) ) )
+void SequenceAVX512( uint32_t * out, size_t count, uint32_t start )
+{
+    bool stream = Streams( out, count );
+    size_t lead = stream ? Lead<64>( out, count ) : 0;
+    SequenceScalar( out, lead, start );
+    out += lead; count -= lead; start += lead;
+
+    __m512i hexa = _mm512_add_epi32( _mm512_set1_epi32( start ),
+                                     _mm512_setr_epi32( 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 ) );
+    const __m512i incr = _mm512_set1_epi32( 16 );
+    size_t body = count & ~( size_t ) 15;
+    if( stream )
+    {
+        for( size_t index = 0; index < body; index += 16, hexa = _mm512_add_epi32( hexa, incr ) )
+        { _mm512_stream_si512( ( __m512i * )( out + index ), hexa ); }
+        _mm_sfence();
+    }
+    else
+    {
+        for( size_t index = 0; index < body; index += 16, hexa = _mm512_add_epi32( hexa, incr ) )
+        { _mm512_storeu_si512( out + index, hexa ); }
+    }
+    SequenceScalar( out + body, count - body, start + body );
+}
+
+__attribute__( ( target( "avx512f" ) ) )
+void SplatAVX512( void * out, uint8_t value, size_t size )
+{
+    if( size < Simd::STREAM_SZ ) { memset( out, value, size ); return; }
+    char * ptr = ( char * ) out;
+    size_t lead = ( 64 - ( uintptr_t ) ptr % 64 ) % 64;
+    memset( ptr, value, lead );
+    ptr += lead; size -= lead;
+
+    const __m512i fill = _mm512_set1_epi32( value * 0x01010101U );
+    size_t body = size & ~( size_t ) 63;
+    for( size_t index = 0; index < body; index += 64 ) { _mm512_stream_si512( ( __m512i * )( ptr + index ), fill ); }
+    _mm_sfence();
+    memset( ptr + body, value, size - body );
+}
+
+#endif // FSVIEW_SIMD_X86
+
+#if FSVIEW_SIMD_NEON
+
+// NEON has no non-temporal store intrinsics; large fills are left to memset()
+void SequenceNEON( uint32_t * out, size_t count, uint32_t start )
+{
+    uint32_t first[4] = { start + 1, start + 2, start + 3, start + 4 };
+    uint32x4_t quad = vld1q_u32( first );
+    const uint32x4_t incr = vdupq_n_u32( 4 );
+    size_t body = count & ~( size_t ) 3;
+    for( size_t index = 0; index < body; index += 4, quad = vaddq_u32( quad, incr ) )
+    { vst1q_u32( out + index, quad ); }
+    SequenceScalar( out + body, count - body, start + body );
+}
+
+#endif // FSVIEW_SIMD_NEON
+
+#if FSVIEW_SIMD_SVE
+
+// vector-length agnostic: the predicate covers the tail
+FSVIEW_TARGET_SVE
+void SequenceSVE( uint32_t * out, size_t count, uint32_t start )
+{
+    bool stream = Streams( out, count );
+    uint64_t lanes = svcntw();
+    svuint32_t seq = svindex_u32( start + 1, 1 );
+    const svuint32_t incr = svdup_n_u32( ( uint32_t ) lanes );
+    for( uint64_t index = 0; index < count; index += lanes, seq = svadd_u32_x( svptrue_b32(), seq, incr ) )
+    {
+        svbool_t active = svwhilelt_b32_u64( index, count );
+        if( stream ) { svstnt1_u32( active, out + index, seq ); }
+        else { svst1_u32( active, out + index, seq ); }
+    }
+}
+
+FSVIEW_TARGET_SVE
+void SplatSVE( void * out, uint8_t value, size_t size )
+{
+    if( size < Simd::STREAM_SZ ) { memset( out, value, size ); return; }
+    uint8_t * ptr = ( uint8_t * ) out;
+    uint64_t lanes = svcntb();
+    const svuint8_t fill = svdup_n_u8( value );
+    for( uint64_t index = 0; index < size; index += lanes )
+    { svstnt1_u8( svwhilelt_b8_u64( index, size ), ptr + index, fill ); }
+}
+
+#endif // FSVIEW_SIMD_SVE
+
+struct Kernels
+{
+    Simd::Isa isa;
+    SequenceFn sequence;
+    SplatFn splat;
+};
+
+/// Ordered by preference, within an architecture.
+const Kernels AllKernels[] =
+{
+    { Simd::Scalar, SequenceScalar, SplatScalar },
+#if FSVIEW_SIMD_X86
+    { Simd::SSE2, SequenceSSE2, SplatSSE2 },
+    { Simd::AVX2, SequenceAVX2, SplatAVX2 },
+    { Simd::AVX512, SequenceAVX512, SplatAVX512 },
+#endif
+#if FSVIEW_SIMD_NEON
+    { Simd::NEON, SequenceNEON, SplatScalar },
+#endif
+#if FSVIEW_SIMD_SVE
+    { Simd::SVE, SequenceSVE, SplatSVE },
+#endif
+};
+
+bool Supported( Simd::Isa isa )
+{
+    switch( isa )
+    {
+    case Simd::Scalar: return true;
+#if FSVIEW_SIMD_X86
+    case Simd::SSE2: return __builtin_cpu_supports( "sse2" );
+    case Simd::AVX2: return __builtin_cpu_supports( "avx2" );
+    case Simd::AVX512: return __builtin_cpu_supports( "avx512f" );
+#endif
+#if FSVIEW_SIMD_NEON
+    case Simd::NEON: return true;
+#endif
+#if FSVIEW_SIMD_SVE
+    case Simd::SVE: return getauxval( AT_HWCAP ) & HWCAP_SVE;
+#endif
+    default: return false;
+    }
+}
+
+std::atomic<const Kernels *> Active( nullptr );
+
+/// Return the kernels in use, resolving the best supported ones on first use.
+const Kernels & Use()
+{
+    const Kernels * kernels = Active.load( std::memory_order_acquire );
+    if( kernels ) { return *kernels; }
+    kernels = &AllKernels[0];
+    for( const Kernels & candidate : AllKernels ) { if( Supported( candidate.isa ) ) { kernels = &candidate; } }
+    Active.store( kernels, std::memory_order_release ); // racing resolutions agree
+    return *kernels;
+}
+
+}
+
+Simd::Isa Simd::Current() { return Use().isa; }
+
+const char * Simd::Name( Isa isa )
+{
+    static const char * const names[IsaCount] = { "scalar", "sse2", "avx2", "avx512", "neon", "sve" };
+    return isa < IsaCount ? names[isa] : "?";
+}
+
+bool Simd::Select( const char * name )
+{
+    for( const Kernels & kernels : AllKernels )
+    {
+        if( strcmp( Name( kernels.isa ), name ) || !Supported( kernels.isa ) ) { continue; }
+        Active.store( &kernels, std::memory_order_release );
+        return true;
+    }
+    return false;
+}
+
+void Simd::Sequence( uint32_t * out, size_t count, uint32_t start ) { Use().sequence( out, count, start ); }
+
+void Simd::Splat( void * out, uint8_t value, size_t size ) { Use().splat( out, value, size ); }
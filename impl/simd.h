@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "wrapper.h"
+
+/// Vectorized kernels of the generated media (the FAT, allocation bitmaps),
+/// dispatched at run time to the widest instruction set the CPU supports.
+/// The choice is made once, on first use, unless overridden with Select().
+/// The scalar kernels are the reference implementation.
+struct Simd
+{
+    enum Isa
+    {
+        Scalar = 0,
+        SSE2,
+        AVX2,
+        AVX512,
+        NEON,
+        SVE,
+        IsaCount
+    };
+
+    /// Return the instruction set in use.
+    static Isa Current();
+
+    /// Return the name of an instruction set: "scalar", "sse2", "avx2", "avx512", "neon" or "sve".
+    static const char * Name( Isa isa );
+
+    /// Use the named instruction set from now on. Return false if the name is unknown,
+    /// or if the set is not built in or not supported by the CPU.
+    static bool Select( const char * name );
+
+    /// Fill count 32-bit words with start + 1, start + 2...
+    static void Sequence( uint32_t * out, size_t count, uint32_t start );
+
+    /// Fill size bytes with the value.
+    static void Splat( void * out, uint8_t value, size_t size );
+
+    /// The size from which the kernels bypass the cache ("non-temporal" stores):
+    /// smaller buffers are written out (thus read back) while still cached.
+    static constexpr const size_t STREAM_SZ = 1 << 20;
+};
+
+#endif // SIMD_H
@@ -24,6 +24,13 @@ void EntryStat::closeFd() { close( lastFd ); lastFd = -1; }
 // openat() can be used for all or most practical purposes.
 const char * Entry::nativePath() const { return absPath.c_str(); }
 
+bool Entry::offerFd( int fd )
+{
+    if( fd < 0 || !describe( fd ) ) { return false; }
+    if( root->generations && ioctl( fd, FS_IOC_GETVERSION, &generation ) < 0 ) { generation = 0; }
+    return true;
+}
+
 bool Entry::offerFd( const char * entry, bool relative )
 {
     auto flags = openFlags();
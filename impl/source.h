@@ -34,6 +34,9 @@ struct Follower
     /// dependency: the native/platform charset decoder
     Ptr<IDecoder> decoder;
 
+    /// Whether to query inode generations (see EntryStat::generation).
+    bool generations = false;
+
 protected:
     virtual ~Follower() = default;
 };
@@ -70,6 +73,10 @@ struct EntryStat
 
     struct stat64 stat;
     mutable int lastFd = -1;
+
+    /// The inode generation (FS_IOC_GETVERSION), if requested by the Follower.
+    /// Tells a reused inode number from the original file.
+    long generation = 0;
 };
 
 /// An abstract entry (folder|file)
@@ -86,7 +93,7 @@ struct Entry : public EntryLand, public EntryStat
     Unicode decoded;
 
     /// Offer a file descriptor to traverse (may be a folder).
-    bool offerFd( int fd ) { return ( fd >= 0 ) && describe( fd ); }
+    bool offerFd( int fd );
 
     /// Offer a file/folder path to traverse.
     bool offerFd( const char * entry, bool relative );
@@ -170,7 +177,7 @@ struct FileEntry : public Entry, public Medium // FIXME duplicates FileMedium!
     blksize_t blockSize() const override { return stat.st_blksize; }
     const char * path() const override { return nativePath(); }
     dev_t blockDevice() const override { return stat.st_dev; }
-    med_id id() const override { return stat.st_ino; }
+    med_id id() const override { return NodeId( stat.st_dev, stat.st_ino ); }
     bool isAligned() const override { return false; }
     int fd() const override;
 
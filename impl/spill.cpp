@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "spill.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace
+{
+
+constexpr const off64_t kMaxSpan = 1LL << 36; ///< the address space to reserve for the spill file
+constexpr const off64_t kMinSpan = 1LL << 30; ///< ...if available, otherwise the largest possible above this
+
+/// The process-wide budget and spill file.
+struct State
+{
+    off64_t budget = 0;
+    const char * dir = nullptr;
+    std::atomic<unsigned> calls{ 0 };
+    std::atomic<bool> over{ false };
+
+    std::mutex guard;       ///< protects the below
+    int fd = -1;            ///< the spill file
+    char * base = nullptr;  ///< its mapping, never moved: the stages of all the shards copy into it unlocked
+    off64_t span = 0;       ///< the address space reserved for the mapping
+    off64_t end = 0;        ///< the end of the claimed regions
+};
+
+State & Global()
+{
+    static State state;
+    return state;
+}
+
+/// Return the resident anonymous memory of the process: resident minus shared
+/// (file-backed) pages, so that the spill file itself doesn't count.
+off64_t AnonResident()
+{
+    unsigned long size = 0, resident = 0, shared = 0;
+    FILE * statm = fopen( "/proc/self/statm", "r" );
+    if( !statm ) { return 0; }
+    if( fscanf( statm, "%lu %lu %lu", &size, &resident, &shared ) != 3 ) { resident = shared = 0; }
+    fclose( statm );
+    return ( off64_t )( resident - shared ) * sysconf( _SC_PAGESIZE );
+}
+
+/// Claim a region of the spill file of (at least) room bytes; return its offset.
+off64_t Claim( off64_t & room )
+{
+    State & state = Global();
+    std::lock_guard<std::mutex> lock( state.guard );
+    if( !state.base )
+    {
+        state.fd = state.dir ? open( state.dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR )
+                   : memfd_open( "spillfd", O_RDWR );
+        if( state.fd < 0 ) { perror( state.dir ? state.dir : "memfd" ); abort(); }
+        // address space only: the file grows under the mapping, which stays in place
+        // (a shared mapping may extend past the end of the file)
+        void * base = MAP_FAILED;
+        for( state.span = kMaxSpan; state.span >= kMinSpan; state.span >>= 1 )
+        {
+            base = mmap( nullptr, state.span, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, state.fd, 0 );
+            if( base != MAP_FAILED ) { break; }
+        }
+        if( base == MAP_FAILED ) { perror( "mmap" ); abort(); }
+        state.base = ( char * ) base;
+    }
+    room = Blocks::roundUp( room, sysconf( _SC_PAGESIZE ) );
+    off64_t at = state.end;
+    state.end += room;
+    if( state.end > state.span ) { printf( "Spill file exceeds %lx bytes\n", state.span ); abort(); }
+    if( ftruncate64( state.fd, state.end ) < 0 ) { perror( "spill" ); abort(); }
+    return at;
+}
+
+/// Give a region of the spill file back to the system (the file keeps its size).
+void Release( off64_t at, off64_t room )
+{
+    fallocate64( Global().fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, room );
+}
+
+/// A region of the spill file staging one extent, moving to the end of the file
+/// (and doubling) whenever it outgrows its room; released when the stage goes.
+class SpillStage : public Burner
+{
+public:
+    SpillStage( blksize_t blkSz ) : _blk_sz( blkSz ) {}
+    ~SpillStage() { if( _room ) { Release( _at, _room ); } }
+    blksize_t blockSize() const override { return _blk_sz; }
+    bool isValid() const override { return true; }
+    off64_t offset() const override { return _length; }
+    const void * data() const override { return Global().base + _at; }
+    void reserve( off64_t size ) override { fit( size ); }
+
+    off64_t append( const Extent & extent ) override
+    {
+        off64_t cur = _length;
+        fit( cur + extent.length );
+        char * out = ( char * ) data() + cur;
+        if( extent.medium && extent.medium->data() )
+        { memcpy( out, ( const char * ) extent.medium->data() + extent.offset, extent.length ); }
+        else if( extent.medium ) { extent.writeToFd( Global().fd, _at + cur ); }
+        else { memset( out, 0, extent.length ); }
+        _length += extent.length;
+        return cur;
+    }
+
+private:
+    void fit( off64_t size )
+    {
+        if( size <= _room ) { return; }
+        off64_t room = std::max( size, _room * 2 );
+        off64_t at = Claim( room );
+        char * base = Global().base;
+        memcpy( base + at, base + _at, _length );
+        if( _room ) { Release( _at, _room ); }
+        _at = at;
+        _room = room;
+    }
+
+    blksize_t _blk_sz;
+    off64_t _at = 0;
+    off64_t _room = 0;
+    off64_t _length = 0;
+};
+
+}
+
+void Spill::Configure( off64_t budget, const char * dir )
+{
+    State & state = Global();
+    state.budget = budget;
+    state.dir = dir;
+}
+
+bool Spill::Over()
+{
+    // /proc reads aren't free: sample every few calls
+    constexpr const unsigned kSampling = 64;
+    State & state = Global();
+    if( !state.budget ) { return false; }
+    if( state.over ) { return true; }
+    if( state.calls++ % kSampling ) { return false; }
+    off64_t used = AnonResident();
+    if( used <= state.budget ) { return false; }
+    if( !state.over.exchange( true ) )
+    { printf( "Memory budget %lx exceeded (%lx): spilling to %s\n", state.budget, used, state.dir ? state.dir : "memfd" ); }
+    return true;
+}
+
+Ptr<Burner> Spill::Stage( blksize_t blkSz ) { return New<SpillStage>( blkSz ); }
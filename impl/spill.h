@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "wrapper.h"
+
+#include "impl/burner.h"
+
+/// A budget of anonymous memory (the heap) for the intermediates of a build.
+/// Once the budget is crossed, the staged extents (directory images and such,
+/// see Burner::stage()) are composed in a "spill" file mapped to memory instead:
+/// the kernel may write its pages back and evict them under memory pressure.
+/// Without a spill directory, the file is a memfd, which may only be swapped.
+/// The file is shared by the concurrent shards: it is mapped once, over a fixed
+/// reservation of address space, and grows under the mapping without moving it.
+struct Spill
+{
+    /// Set the budget (zero: unlimited) and the directory of the spill file (null: a memfd).
+    static void Configure( off64_t budget, const char * dir );
+
+    /// Whether the budget has been crossed. Sampled every few calls; once crossed, stays so.
+    static bool Over();
+
+    /// Return a Burner staging an extent in the spill file. The extent may grow,
+    /// moving to the end of the file: data() is only valid until the next append().
+    static Ptr<Burner> Stage( blksize_t blkSz );
+};
+
+#endif // SPILL_H
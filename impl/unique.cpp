@@ -97,6 +97,21 @@ uint32_t Crc32( const char * str )
     return ~crc;
 }
 
+uint32_t Crc32( const void * data, size_t size, uint32_t crc )
+{
+    const uint8_t * bytes = ( const uint8_t * ) data;
+    crc = ~crc;
+    for( size_t i = 0; i < size; ++i )
+    {
+#ifdef __ARM_FEATURE_CRC32
+        crc = __crc32b( crc, bytes[i] );
+#else
+        crc = legacy_crc[( crc ^ bytes[i] ) & 0xff] ^ ( crc >> 8 );
+#endif
+    }
+    return ~crc;
+}
+
 // Unique file name generation.
 
 int Unicomp::cmp( const Unicomp & other ) const
@@ -135,24 +150,76 @@ int Mt19937::variant( int attempt )
     return dist( engine );
 }
 
+void CrcVariant::reseed( const Unicode & origName, size_t taken )
+{
+    _seed = Crc32( origName.data(), origName.size() * sizeof( wchar_t ) );
+    for( _span = 10; ( size_t ) _span < 2 * ( taken + 1 ) && _span < 100000000; _span *= 10 );
+}
+
+int CrcVariant::variant( int attempt )
+{
+    if( !attempt ) { return 0; }
+    // widen the range every few attempts, in case the names taken are clustered
+    int span = _span;
+    for( int wide = ( attempt - 1 ) / 4; wide-- && span < 100000000; span *= 10 );
+    return 1 + Crc32( &attempt, sizeof( attempt ), _seed ) % span;
+}
+
+size_t NameSet::probe( const Unicode & name, uint32_t hash ) const
+{
+    size_t mask = _slots.size() - 1;
+    size_t slot = hash & mask;
+    for( ; _slots[slot]; slot = ( slot + 1 ) & mask )
+    {
+        size_t pos = _slots[slot] - 1;
+        if( _hashes[pos] == hash && _names[pos] == name ) { break; }
+    }
+    return slot;
+}
+
+void NameSet::grow()
+{
+    std::vector<size_t> slots( std::max<size_t>( 16, _slots.size() * 2 ), 0 );
+    std::swap( _slots, slots );
+    for( size_t pos = 0; pos < _names.size(); ++pos )
+    { _slots[probe( _names[pos], _hashes[pos] )] = pos + 1; }
+}
+
+size_t NameSet::find( const Unicode & name ) const
+{
+    if( _slots.empty() ) { return npos; }
+    size_t slot = probe( name, Crc32( name.data(), name.size() * sizeof( wchar_t ) ) );
+    return _slots[slot] ? _slots[slot] - 1 : npos;
+}
+
+std::pair<size_t, bool> NameSet::insert( const Unicode & name )
+{
+    if( 2 * ( _names.size() + 1 ) > _slots.size() ) { grow(); } // keep the load factor under 1/2
+    uint32_t hash = Crc32( name.data(), name.size() * sizeof( wchar_t ) );
+    size_t slot = probe( name, hash );
+    if( _slots[slot] ) { return { _slots[slot] - 1, false }; }
+    _names.push_back( name );
+    _hashes.push_back( hash );
+    _slots[slot] = _names.size();
+    return { _names.size() - 1, true };
+}
+
 void NamePool::tryExisting( UniqName & name ) const
 {
     if( name.link.size() ) // don't allow empty base names
     {
-        auto itr = linkToConv.find( name.link );
-        if( itr != linkToConv.end() ) { name.conv = itr->second; }
+        size_t pos = links.find( name.link );
+        if( pos != NameSet::npos ) { name.conv = linkConvs[pos]; }
     }
 }
 
 bool NamePool::tryBrandNew( UniqName & name )
 {
-    if( convToLink.find( name.conv ) == convToLink.end() )
-    {
-        convToLink[name.conv] = name.link;
-        linkToConv[name.link] = name.conv;
-        return true;
-    }
-    else { return false; }
+    if( !convs.insert( name.conv ).second ) { return false; }
+    auto link = links.insert( name.link );
+    if( link.second ) { linkConvs.push_back( name.conv ); }
+    else { linkConvs[link.first] = name.conv; }
+    return true;
 }
 
 Unicomp NamePool::fitName( const Unicode & origName, bool isFile, const INameRule & rule, IVariant & shuf )
@@ -162,6 +229,7 @@ Unicomp NamePool::fitName( const Unicode & origName, bool isFile, const INameRul
     tryExisting( uniqName );
     if( uniqName.conv.empty() ) // existing not found
     {
+        shuf.reseed( origName, convs.size() );
         int attempt = 0; // zero try means unmodified
         do { rule.mixInVar( uniqName, shuf.variant( attempt++ ) ); }
         while( !tryBrandNew( uniqName ) );
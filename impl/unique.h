@@ -16,6 +16,9 @@
 // string jamming is used to compact the device serial number preserving variability.
 uint32_t Crc32( const char * str ); // Equivalent to cksum -o 3
 
+/// The CRC-32 of a memory area. Chainable: pass the CRC of the preceding data as crc.
+uint32_t Crc32( const void * data, size_t size, uint32_t crc = 0 );
+
 /* The requirements to the name pool is as follows:
  * - there is a length limit that needs to be enforced; (30 for ISO 9660 Level 3, let's say 120 for Joliet);
  * - there is a character set that needs to be enforced ('d-characters' for 9660, all -specials for Joliet);
@@ -71,6 +74,8 @@ struct UniqName : public Unicomp
 /// Produces numeric suffices to append to a file name at a given retry attempt.
 struct IVariant
 {
+    /// Prepare the variants of a name, given the number of names already taken.
+    virtual void reseed( const Unicode & /*origName*/, size_t /*taken*/ ) {}
     virtual int variant( int attempt ) = 0;
     virtual ~IVariant() = default;
 };
@@ -90,6 +95,20 @@ struct Mt19937 : public IVariant
     std::mt19937 engine;
 };
 
+/// Implements IVariant deterministically: the variants of a name are drawn from
+/// the CRC of the name, so a name gets the same variant on every rebuild and in
+/// any traversal order. The range of variants is kept at least twice the number
+/// of names taken, so that the expected number of attempts is constant.
+struct CrcVariant : public IVariant
+{
+    void reseed( const Unicode & origName, size_t taken ) override;
+    int variant( int attempt ) override;
+
+private:
+    uint32_t _seed = 0;
+    int _span = 10;
+};
+
 /// A name variation engine. Stateless; does not own or cache the name in any way, only defines the rules.
 struct INameRule
 {
@@ -208,15 +227,40 @@ using FatVolRule = CDFSRule<VFatChar, CDFSLvl1, &EnsureD<wchar_t>, false>;
 
 // D-chars (allowed for file names) are: A-Z0-9_
 
+/// A set of names; an open-addressing hash table with linear probing.
+/// Names are kept in the insertion order and addressed by their position.
+struct NameSet
+{
+    static constexpr const size_t npos = ~( size_t ) 0;
+
+    /// Return the position of a name, or npos if absent.
+    size_t find( const Unicode & name ) const;
+
+    /// Insert a name unless present. Return its position and whether it was inserted.
+    std::pair<size_t, bool> insert( const Unicode & name );
+
+    size_t size() const { return _names.size(); }
+
+private:
+    /// Return the slot holding the name, or the empty slot where the name belongs.
+    size_t probe( const Unicode & name, uint32_t hash ) const;
+    void grow();
+
+    std::vector<Unicode> _names;
+    std::vector<uint32_t> _hashes; ///< of the names
+    std::vector<size_t> _slots;    ///< name positions + 1; 0 is empty. A power of two in size
+};
+
 /// This structure is pertinent to a source (or virtual source) directory.
 /// It ensures that distinct source file names are canonicalized into unique compliant target names.
+/// Names should be fitted in a stable (e.g. sorted) order for the outcome to be stable.
 struct NamePool
 {
     /// The facade method.
     /// @param[in] origName     name in the source file tree
     /// @param[in] isFile       whether the name is a regular file (not a folder)
     /// @param[in] rule         the canonicalization rule
-    /// @param[in] shuf         the numeric suffix generator, such as StdRand or Mt19937
+    /// @param[in] shuf         the numeric suffix generator, such as CrcVariant or StdRand
     /// @returns    a properly transliterated, trimmed, "uniqualized" and delimited output file name.
     Unicomp fitName( const Unicode & origName, bool isFile, const INameRule & rule, IVariant & shuf );
 
@@ -224,9 +268,9 @@ private:
     void tryExisting( UniqName & name ) const;  ///< attempts to use an existing name mapping
     bool tryBrandNew( UniqName & name );        ///< attempts to register a new name mapping
 
-    // FIXME Map<Unicode, Unicode> to allow sharing
-    std::map<Unicode, Unicode> convToLink;
-    std::map<Unicode, Unicode> linkToConv;
+    NameSet convs;                  ///< the target names taken
+    NameSet links;                  ///< the source base names given a target name
+    std::vector<Unicode> linkConvs; ///< the target name of each of links
 };
 
 #endif // UNIQUE_H
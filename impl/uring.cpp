@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "uring.h"
+
+Uring::Uring( unsigned depth ) : _ring_fd( -1 )
+{
+    struct io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    int ringFd = syscall( __NR_io_uring_setup, depth, &params );
+    if( ringFd < 0 ) { return; }
+
+    // plain (unregistered) writes need Linux 5.6
+    std::vector<char> space( sizeof( struct io_uring_probe ) + IORING_OP_LAST * sizeof( struct io_uring_probe_op ), 0 );
+    struct io_uring_probe * probe = ( struct io_uring_probe * ) space.data();
+    if( syscall( __NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST ) < 0
+        || probe->last_op < IORING_OP_WRITE
+        || !( probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED ) )
+    {
+        close( ringFd );
+        return;
+    }
+
+    _sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    _cq_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if( single ) { _sq_size = _cq_size = std::max( _sq_size, _cq_size ); }
+
+    _sq_ptr = mmap( nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING );
+    _cq_ptr = single ? _sq_ptr
+              : mmap( nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING );
+    _sqes = ( struct io_uring_sqe * ) mmap( nullptr, params.sq_entries * sizeof( struct io_uring_sqe ),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES );
+    _ring_fd = ringFd;
+    _entries = params.sq_entries;
+    if( _sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED || _sqes == MAP_FAILED )
+    {
+        perror( "mmap(io_uring)" );
+        release();
+        return;
+    }
+
+    char * sq = ( char * ) _sq_ptr;
+    _sq_tail = ( unsigned * )( sq + params.sq_off.tail );
+    _sq_mask = ( unsigned * )( sq + params.sq_off.ring_mask );
+    _sq_array = ( unsigned * )( sq + params.sq_off.array );
+    char * cq = ( char * ) _cq_ptr;
+    _cq_head = ( unsigned * )( cq + params.cq_off.head );
+    _cq_tail = ( unsigned * )( cq + params.cq_off.tail );
+    _cq_mask = ( unsigned * )( cq + params.cq_off.ring_mask );
+    _cqes = ( struct io_uring_cqe * )( cq + params.cq_off.cqes );
+}
+
+Uring::~Uring() { release(); }
+
+void Uring::release()
+{
+    if( _ring_fd < 0 ) { return; }
+    if( _sqes != MAP_FAILED ) { munmap( _sqes, _entries * sizeof( struct io_uring_sqe ) ); }
+    if( _cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr ) { munmap( _cq_ptr, _cq_size ); }
+    if( _sq_ptr != MAP_FAILED ) { munmap( _sq_ptr, _sq_size ); }
+    close( _ring_fd );
+    _ring_fd = -1;
+}
+
+bool Uring::registerBuffers( const std::vector<struct iovec> & buffers )
+{
+    return syscall( __NR_io_uring_register, _ring_fd, IORING_REGISTER_BUFFERS,
+                    buffers.data(), ( unsigned ) buffers.size() ) >= 0;
+}
+
+void Uring::write( int fd, const void * data, unsigned size, off64_t at, int buffer, uint64_t tag )
+{
+    if( _queued + _inflight >= _entries ) { reap( _entries - 1 ); }
+
+    unsigned tail = *_sq_tail; // only this thread moves the tail
+    unsigned index = tail & *_sq_mask;
+    struct io_uring_sqe & sqe = _sqes[index];
+    memset( &sqe, 0, sizeof( sqe ) );
+    sqe.opcode = buffer < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+    sqe.fd = fd;
+    sqe.addr = ( uintptr_t ) data;
+    sqe.len = size;
+    sqe.off = at;
+    sqe.buf_index = buffer < 0 ? 0 : buffer;
+    sqe.user_data = tag;
+    _sq_array[index] = index;
+    __atomic_store_n( _sq_tail, tail + 1, __ATOMIC_RELEASE );
+    ++_queued;
+}
+
+void Uring::reap( unsigned inFlight )
+{
+    while( _queued || _inflight > inFlight )
+    {
+        enter( _inflight + _queued > inFlight ? 1 : 0 );
+
+        unsigned head = *_cq_head;
+        while( head != __atomic_load_n( _cq_tail, __ATOMIC_ACQUIRE ) )
+        {
+            struct io_uring_cqe & cqe = _cqes[head & *_cq_mask];
+            uint64_t tag = cqe.user_data;
+            int result = cqe.res;
+            __atomic_store_n( _cq_head, ++head, __ATOMIC_RELEASE );
+            --_inflight;
+            if( onDone ) { onDone( tag, result ); } // may queue more writes
+        }
+    }
+}
+
+void Uring::enter( unsigned minComplete )
+{
+    while( true )
+    {
+        int done = syscall( __NR_io_uring_enter, _ring_fd, _queued, minComplete,
+                            minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0 );
+        if( done >= 0 )
+        {
+            _inflight += done;
+            _queued -= done;
+            return;
+        }
+        if( errno != EINTR && errno != EAGAIN && errno != EBUSY ) { perror( "io_uring_enter" ); abort(); }
+    }
+}
+
+UringWriter::UringWriter( int outFd, Workers & copiers )
+    : _out_fd( outFd ), _copiers( copiers ), _ring( kDepth )
+{
+    if( !_ring.isValid() ) { return; }
+    _ring.onDone = [this]( uint64_t tag, int result ) { done( tag, result ); };
+
+    for( unsigned index = 0; index < kBuffers; ++index )
+    {
+        _buffers.push_back( { memalign( sysconf( _SC_PAGESIZE ), kBufferSz ), kBufferSz } );
+        _busy.push_back( false );
+    }
+    _fixed = _ring.registerBuffers( _buffers ); // plain writes otherwise
+}
+
+UringWriter::~UringWriter()
+{
+    for( auto & buffer : _buffers ) { free( buffer.iov_base ); }
+}
+
+void UringWriter::put( const Extent & extent, off64_t at )
+{
+    const Medium * medium = extent.medium.get();
+    if( !medium || !extent.length ) { return; }
+
+    auto submit = [this]( const char * data, unsigned size, off64_t at, int buffer )
+    {
+        uint64_t tag;
+        if( _tags.empty() ) { tag = _pending.size(); _pending.push_back( {} ); }
+        else { tag = _tags.back(); _tags.pop_back(); }
+        _pending[tag] = { data, size, at, buffer };
+        _ring.write( _out_fd, data, size, at, _fixed ? buffer : -1, tag );
+    };
+
+    if( medium->data() )
+    {
+        constexpr const off64_t kMaxWrite = 1 << 30;
+        const char * data = ( const char * ) medium->data() + extent.offset;
+        for( off64_t done = 0; done < extent.length; done += kMaxWrite )
+        { submit( data + done, std::min( extent.length - done, kMaxWrite ), at + done, -1 ); }
+        return;
+    }
+
+    const RuleMedium * rule = dynamic_cast<const RuleMedium *>( medium );
+    if( rule )
+    {
+        off64_t step = std::min<off64_t>( rule->chunkSize(), kBufferSz );
+        off64_t last = extent.offset + extent.length;
+        for( off64_t next = extent.offset; next < last; next += step )
+        {
+            int buffer = takeBuffer();
+            char * chunk = ( char * ) _buffers[buffer].iov_base;
+            auto part = std::min( last - next, step );
+            rule->generate( chunk, next, part );
+            submit( chunk, part, at + next - extent.offset, buffer );
+        }
+        return;
+    }
+
+    if( medium->fd() >= 0 || medium->path() )
+    {
+        _copiers.post( [this, extent, at]() { extent.writeToFd( _out_fd, at ); } );
+    }
+    // else: zeros
+}
+
+int UringWriter::takeBuffer()
+{
+    while( true )
+    {
+        for( unsigned index = 0; index < _busy.size(); ++index )
+        {
+            if( !_busy[index] ) { _busy[index] = true; return index; }
+        }
+        _ring.reap( _ring.inFlight() - 1 ); // all buffers are in flight: wait for one write
+    }
+}
+
+void UringWriter::done( uint64_t tag, int result )
+{
+    Pending pending = _pending[tag];
+    _tags.push_back( tag );
+    if( result < 0 ) { errno = -result; perror( "io_uring write" ); abort(); }
+
+    // finish a short write synchronously
+    for( unsigned done = result; done < pending.size; )
+    {
+        ssize_t written = pwrite64( _out_fd, pending.data + done, pending.size - done, pending.at + done );
+        if( written < 0 && errno == EINTR ) { continue; }
+        if( written <= 0 ) { perror( "pwrite" ); abort(); }
+        done += written;
+    }
+    if( pending.buffer >= 0 ) { _busy[pending.buffer] = false; }
+}
+
+void UringWriter::finish()
+{
+    _ring.reap( 0 );
+    _copiers.drain();
+}
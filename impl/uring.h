@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "wrapper.h"
+
+#include "impl/extent.h"
+#include "impl/worker.h"
+
+/// A minimal io_uring submission/completion queue pair, set up with raw system
+/// calls (no liburing). Keeps many positional writes in flight from one thread.
+struct Uring
+{
+    typedef std::function<void( uint64_t tag, int result )> OnDone;
+
+    /// Set up a ring of the provided depth. io_uring may be missing (before
+    /// Linux 5.6, for plain writes) or forbidden (seccomp): check isValid().
+    explicit Uring( unsigned depth );
+    ~Uring();
+
+    bool isValid() const { return _ring_fd >= 0; }
+
+    /// Register the buffers for fixed writes; return false if refused.
+    bool registerBuffers( const std::vector<struct iovec> & buffers );
+
+    /// Queue a write at the provided offset: of a registered buffer (by index),
+    /// or of any memory if the index is negative. Reaps completions while full.
+    void write( int fd, const void * data, unsigned size, off64_t at, int buffer, uint64_t tag );
+
+    /// Submit the queued writes and wait until at most the provided number
+    /// of writes is in flight, passing the completions to onDone.
+    void reap( unsigned inFlight = 0 );
+
+    /// Return the number of queued or submitted writes not yet completed.
+    unsigned inFlight() const { return _queued + _inflight; }
+
+    OnDone onDone;
+
+private:
+    void enter( unsigned minComplete );
+    void release();
+
+    int _ring_fd;
+    unsigned _entries = 0;
+    unsigned _queued = 0;   ///< written to the submission queue, not yet submitted
+    unsigned _inflight = 0; ///< submitted, not yet completed
+
+    void * _sq_ptr = MAP_FAILED;
+    void * _cq_ptr = MAP_FAILED;
+    size_t _sq_size = 0, _cq_size = 0;
+    struct io_uring_sqe * _sqes = ( struct io_uring_sqe * ) MAP_FAILED;
+    unsigned * _sq_tail, * _sq_mask, * _sq_array;
+    unsigned * _cq_head, * _cq_tail, * _cq_mask;
+    struct io_uring_cqe * _cqes;
+};
+
+/// Writes extents at precomputed offsets through a Uring. Memory-backed extents
+/// are written straight from their memory; generated (RuleMedium) extents go
+/// through a few registered buffers, filled while the previous ones are being
+/// written; file-backed extents are copied by a pool of threads meanwhile.
+struct UringWriter
+{
+    UringWriter( int outFd, Workers & copiers );
+    ~UringWriter();
+
+    bool isValid() const { return _ring.isValid(); }
+
+    /// Queue the extent to be written at the provided offset.
+    void put( const Extent & extent, off64_t at );
+
+    /// Wait for all the writes.
+    void finish();
+
+private:
+    /// Handle a completion: retry a short write, release the buffer.
+    void done( uint64_t tag, int result );
+
+    /// Return a free buffer, reaping completions if needed.
+    int takeBuffer();
+
+    struct Pending
+    {
+        const char * data;
+        unsigned size;
+        off64_t at;
+        int buffer;
+    };
+
+    static constexpr const unsigned kDepth = 64;
+    static constexpr const unsigned kBuffers = 4;
+    static constexpr const size_t kBufferSz = 1 << 20;
+
+    int _out_fd;
+    Workers & _copiers;
+    Uring _ring;
+    std::vector<Pending> _pending; ///< indexed by the tag
+    std::vector<uint64_t> _tags;   ///< free tags
+    std::vector<struct iovec> _buffers;
+    std::vector<bool> _busy;
+    bool _fixed = false;
+};
+
+#endif // URING_H
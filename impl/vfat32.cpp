@@ -6,29 +6,9 @@
 
 #include "impl/vfat32.h"
 #include "impl/datetm.h"
+#include "impl/simd.h"
 #include "impl/unique.h"
 
-#ifdef __ARM_NEON
-#include <arm_neon.h>
-#define FSVIEW_FAT32_VECTORIZED_FILL 1
-#define FSVIEW_FAT32_VECTORIZED_FILL_NEON 1
-#elif defined(__SSE2__)
-#include <immintrin.h>
-#define FSVIEW_FAT32_VECTORIZED_FILL 1
-#define FSVIEW_FAT32_VECTORIZED_FILL_SSE2 1
-#endif
-
-namespace
-{
-#if FSVIEW_FAT32_VECTORIZED_FILL_NEON
-using ClusterVec = uint32x4_t;
-#elif FSVIEW_FAT32_VECTORIZED_FILL_SSE2
-using ClusterVec = __m128i;
-#else
-using ClusterVec = uint32_t;
-#endif
-}
-
 namespace VF
 {
 
@@ -141,8 +121,7 @@ size_t LongNameEntry::scatterUcs2( std::string & temp, const Unicode & in )
     return temp.size() / SLICE_SZ;
 }
 
-// accelerated FAT writing. we may want to have multiple implementations
-// of the star dust medium, such as vectorized and scalar
+// accelerated FAT writing: the sequences are generated by the widest Simd kernels
 void VFatMedium::reserve( blkcnt_t blockCount )
 {
     _total_length = blockCount * sizeof( uint32_t );
@@ -151,27 +130,31 @@ void VFatMedium::reserve( blkcnt_t blockCount )
 
 void VFatMedium::setLine( blkcnt_t curFirst, blkcnt_t curLast )
 {
-    if( _favor_freespace )
+    // on sparse partitions, free space is the rule and chains are the exceptions
+    if( _favor_freespace ) { if( curFirst < curLast ) { _lines.emplace_back( curFirst, curLast ); } }
+    else { shadow( curFirst ); } // terminate the chain that leads here
+}
+
+void VFatMedium::seal()
+{
+    // adjacent (or overlapping) runs link the same way: merge them
+    std::sort( _lines.begin(), _lines.end() );
+    size_t kept = 0;
+    for( const Line & line : _lines )
     {
-        // printf( "%lu ... %lu\n", curFirst, curLast );
-        for( auto blk = curFirst; blk < curLast; )
-        {
-            // this seems grossly inefficient, but that's the point of
-            // sparse partitions: free space is cheap, while files are
-            // scarce and don't impose much burden either.
-            off64_t offset = blk * sizeof( uint32_t );
-            amendments[offset] = Store<LSB<uint32_t>>( offset, ++blk );
-        }
+        if( kept && line.first <= _lines[kept - 1].second )
+        { _lines[kept - 1].second = std::max( _lines[kept - 1].second, line.second ); }
+        else { _lines[kept++] = line; }
     }
-    else { shadow( curFirst ); } // terminate the chain that leads here
+    _lines.resize( kept );
+    amendments.seal();
 }
 
 void VFatMedium::shadow( blkcnt_t curFirst )
 {
     if( curFirst <= SEEDCLS /*2*/ ) { return; }
     off64_t offset = ( curFirst - 1 ) * sizeof( uint32_t );
-    if( amendments.find( offset ) == amendments.end() )
-    { amendments[offset] = Store<LSB<uint32_t>>( offset, ENDMARK ); }
+    amendments.putWeak( offset, LSB<uint32_t>( ENDMARK ) );
 }
 
 void VFatMedium::setNext( blkcnt_t lastPrev, blkcnt_t firstNext )
@@ -183,7 +166,7 @@ void VFatMedium::setNext( blkcnt_t lastPrev, blkcnt_t firstNext )
                 offset, _total_length );
         abort();
     }
-    amendments[offset] = Store<LSB<uint32_t>>( offset, firstNext );
+    amendments.put( offset, LSB<uint32_t>( firstNext ) );
 }
 
 void VFatMedium::setLast( blkcnt_t lastLast )
@@ -191,45 +174,45 @@ void VFatMedium::setLast( blkcnt_t lastLast )
     setNext( lastLast, ENDMARK );
 }
 
-blksize_t VFatMedium::blockSize() const { return sizeof( ClusterVec ); }
+blksize_t VFatMedium::blockSize() const { return 64; } // a cache line, the widest vector (AVX-512)
 
 void VFatMedium::fill( void * chunk, off64_t offset, size_t size ) const
 {
-    if( _favor_freespace )
+    uint32_t * words = ( uint32_t * ) chunk;
+    blkcnt_t begin = offset / sizeof( uint32_t );
+    blkcnt_t end = begin + size / sizeof( uint32_t );
+    if( !_favor_freespace )
     {
-        if( !offset )
-        {
-            memset( chunk, 0, size );
-        }
+        Simd::Sequence( words, end - begin, begin );
         return;
     }
-    // 01 00 00 00 02 00 00 00  03 00 00 00 04 00 00 00
-    ClusterVec * optr = ( ClusterVec * ) chunk;
-    uint32_t startVal = offset / sizeof( uint32_t );
-#if FSVIEW_FAT32_VECTORIZED_FILL
-    uint32_t first[4] = { 1+startVal, 2+startVal, 3+startVal, 4+startVal };
-    uint32_t wordStep = 4;
-#if FSVIEW_FAT32_VECTORIZED_FILL_NEON
-    ClusterVec quad = vld1q_u32( first );
-    ClusterVec incr = vld1q_dup_u32( &wordStep );
-#elif FSVIEW_FAT32_VECTORIZED_FILL_SSE2
-    ClusterVec quad = _mm_loadu_si128( reinterpret_cast<const ClusterVec*>( first ) );
-    ClusterVec incr = _mm_set1_epi32( wordStep );
-#endif
-#endif
-    ClusterVec * last = ( ClusterVec * )( ( char * ) chunk + size );
-    while( optr < last )
+
+    // free space is zero, except for the runs of linked clusters
+    Simd::Splat( chunk, 0, size );
+    auto itr = std::upper_bound( _lines.begin(), _lines.end(), begin, []( blkcnt_t at, const Line & line )
     {
-#if FSVIEW_FAT32_VECTORIZED_FILL_NEON
-        vst1q_u32( reinterpret_cast<unsigned int *>( optr++ ), quad );
-        quad = vaddq_u32( quad, incr );
-#elif FSVIEW_FAT32_VECTORIZED_FILL_SSE2
-        _mm_storeu_si128( optr++, quad );
-        quad = _mm_add_epi32( quad, incr );
-#else // neither, scalar
-        *optr++ = ++startVal;
-#endif
-    };
+        return at < line.second;
+    } );
+    for( ; itr != _lines.end() && itr->first < end; ++itr )
+    {
+        blkcnt_t from = std::max( itr->first, begin ), till = std::min( itr->second, end );
+        Simd::Sequence( words + ( from - begin ), till - from, from );
+    }
+}
+
+off64_t VFatMedium::constant( const Range & range, uint8_t & value ) const
+{
+    // only the free space of sparse partitions is constant (zero)
+    if( !_favor_freespace ) { return 0; }
+    value = 0;
+    blkcnt_t begin = range.offset / sizeof( uint32_t );
+    auto itr = std::upper_bound( _lines.begin(), _lines.end(), begin, []( blkcnt_t at, const Line & line )
+    {
+        return at < line.second;
+    } );
+    if( itr == _lines.end() ) { return range.length; }
+    off64_t next = itr->first * sizeof( uint32_t );
+    return std::max<off64_t>( std::min( next - range.offset, range.length ), 0 );
 }
 
 void VFat32Out::setLabels( const char * system, const char * volume )
@@ -289,7 +272,7 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
                             0xff, 0xff, 0xff, 0xff
                           };
     } bitflags;
-    faTable->amendments[0] = Later::Store( 0, bitflags );
+    faTable->amendments.put( 0, bitflags );
     if( !_scratch ) { faTable->setLast( blkCount - 1 ); }
 
     planHeaders( tmpPlanner ); // autopad inside
@@ -309,21 +292,20 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
     for( auto & lao : tree.layout )
     {
         // TODO own the below code within faTable ("setChain")
-        const ExtentList & xl = lao.second;
-        auto itr = xl.rbegin();
-        if( itr != xl.rend() )
+        // contiguous runs are chained in a single line
+        std::vector<Range> runs = srcToTrg.translate( lao.second );
+        auto itr = runs.rbegin();
+        if( itr != runs.rend() )
         {
-            Extent curr = *itr;
-            curr.offset = srcToTrg.withinArea( curr ); // FIXME amend cluster ID here, not in devices.cpp!
+            Range curr = itr->translate( -srcToTrg.areaOffset ); // FIXME amend cluster ID here, not in devices.cpp!
             // printf( "Finishing %lx+%lx\n", curr.offset, curr.length );
             blkcnt_t first = firstBlk( curr ), last = lastBlk( curr );
             faTable->setLine( first, last );
             faTable->setLast( last );
             // return point
-            while( ++itr != xl.rend() )
+            while( ++itr != runs.rend() )
             {
-                Extent past = *itr;
-                past.offset = srcToTrg.withinArea( past );
+                Range past = itr->translate( -srcToTrg.areaOffset );
                 // printf( "Linking %lx+%lx to %lx+%lx\n", past.offset, past.length, curr.offset, curr.length );
                 first = firstBlk( past ), last = lastBlk( past );
                 faTable->setLine( first, last );
@@ -343,43 +325,39 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
     CharANSI pack;
 
     // similar to CDFS, slightly simpler
-    std::map<PathEntry *, std::list<Later::Use>> parents;
+    BackLinks<DirectoryEntry> parents;
     const blksize_t blkSz = blockSize();
     std::map<Entry *, Extent> dirLayout;
 
-    for( auto itr = tree.pathTable.rbegin(); itr != tree.pathTable.rend(); ++itr )
+    /// The entries of a folder, and the offsets of the entries of its subfolders.
+    struct Draft
     {
-        PathEntry * pDir = *itr;
-        auto dirOffset = tmpPlanner.offset() + tmpToFat;
-        auto dirClustr = firstBlk( dirOffset );
+        Ptr<Burner> records;
+        std::vector<std::pair<off64_t, Entry *>> subs;
+    };
+    // the first two entries of a subfolder are dot and dotdot
+    constexpr const off64_t ownOffset = 0, parentOffset = sizeof( DirectoryEntry );
 
+    auto encode = [&]( PathEntry * pDir, Draft & draft )
+    {
         // see respective code in CDFS
-        Ptr<Burner> dirBurner = New<VectBurner>( blkSz ); // New<TempBurner>(blkSz)
+        Ptr<Burner> dirBurner = draft.records = New<VectBurner>( blkSz );
         dirBurner->reserve( blkSz );
 
         if( pDir->parent )
         {
             DirectoryEntry dot;
 
-            // dot
+            // dot; the start clusters will be written on placement
             dot.baseName.data[0] = '.';
-            dot.setStartCluster( dirClustr );
             dot.setStat( pDir->stat );
             dot.markDir();
-            dirBurner->append( TempExtent<DirectoryEntry>( dot ) ); // all done for dot
+            dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
 
             // dotdot
-            PathEntry * parent = pDir->parent;
             dot.baseName.data[1] = '.';
-            dot.setStat( parent->stat );
-            off64_t parentOffset = dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
-            // TODO see comment about hiding Later::Store
-            parents[parent].push_back( Later::Store<DirectoryEntry>( DtOf( dirBurner ),
-                                                                     parentOffset, dot,
-                                                                     [this]( DirectoryEntry & lfield, const Range & range )
-            {
-                lfield.setStartCluster( firstBlk( range.offset ) );
-            } ) );
+            dot.setStat( pDir->parent->stat );
+            dirBurner->append( TempExtent<DirectoryEntry>( dot ) );
         }
         else
         {
@@ -394,8 +372,6 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
             vol.setMTime( ts );
             vol.setStartCluster( 0 );
             dirBurner->append( TempExtent<DirectoryEntry>( vol ) ); // all done for vol
-
-            _vol.rootCl = dirClustr;
         }
 
         // (loop, loop)
@@ -414,7 +390,7 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
             }
             else
             {
-                sub.setStartCluster( firstBlk( dirLayout.at( pEnt.get() ) ) );
+                // the start cluster will be written on placement
                 sub.markDir();
             }
             sub.setStat( pEnt->stat );
@@ -453,7 +429,7 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
                 std::string actualName;
                 auto seq = LongNameEntry::scatterUcs2( actualName, pEnt->decoded );
                 LongNameEntry lfne;
-                lfne.crc = sub.checksum();
+                lfne.crc = sub.checksum(); // of the short name only
                 do
                 {
                     lfne.copyIn( actualName, seq );
@@ -461,9 +437,38 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
                 }
                 while( --seq );
             }
-            dirBurner->append( TempExtent<DirectoryEntry>( sub ) );
+            off64_t subOffset = dirBurner->append( TempExtent<DirectoryEntry>( sub ) );
+            if( !pEnt->isFile() ) { draft.subs.emplace_back( subOffset, pEnt.get() ); }
         }
         dirBurner->append( ZeroExtent( sizeof( DirectoryEntry ) ) );
+    };
+    auto place = [&]( PathEntry * pDir, Draft & draft )
+    {
+        auto dirOffset = tmpPlanner.offset() + tmpToFat;
+        auto dirClustr = firstBlk( dirOffset );
+
+        Ptr<Burner> dirBurner = tmpPlanner.stage( blkSz );
+        dirBurner->reserve( draft.records->offset() );
+        dirBurner->append( Extent( 0, draft.records->offset(), draft.records ) );
+        draft.records.reset();
+        // the staged data may move as it grows; address the entries after appending
+        auto entryAt = [&dirBurner]( off64_t offset ) -> DirectoryEntry &
+        { return *( DirectoryEntry * )( ( char * ) dirBurner->data() + offset ); };
+
+        if( pDir->parent )
+        {
+            entryAt( ownOffset ).setStartCluster( dirClustr );
+            entryAt( parentOffset ).setStartCluster( dirClustr );
+            parents.add( pDir->parent, dirBurner, parentOffset ); // for the start cluster
+        }
+        else
+        {
+            _vol.rootCl = dirClustr;
+        }
+        for( auto & sub : draft.subs )
+        {
+            entryAt( sub.first ).setStartCluster( firstBlk( dirLayout.at( sub.second ) ) );
+        }
 
         // commit folder
         tmpPlanner.append( WrapToGo( dirBurner ) ); // directory extent roundup
@@ -473,14 +478,12 @@ Colonies VFat32Out::plan( const Original & tree, Planner & outPlanner, Planner &
         faTable->setLast( last );
         dirLayout[pDir] = ownExtent;
 
-        // propagate to children. DRY common code w/ CDFS!
-        auto catchup = parents.find( pDir );
-        if( catchup != parents.end() )
-        {
-            for( auto & use : catchup->second ) { use( ownExtent ); }
-            //1// parents.erase( catchup ); // MOREINFO will it speed up lookup?
-        }
-    }
+        // propagate to children
+        parents.settle( pDir, [&]( DirectoryEntry & link ) { link.setStartCluster( first ); } );
+    };
+    DraftFolders<Draft>( tree.pathTable, _jobs, encode, place );
+
+    faTable->seal();
 
     // TODO allow extent conversion if a real file is appended; make it a fallback
     outPlanner.append( tmpPlanner.wrapToGo( innerOff ) );
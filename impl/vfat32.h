@@ -196,7 +196,7 @@ struct VFatMedium : public RuleMedium
     VFatMedium( bool sparse ) : _favor_freespace( sparse ) {}
 
     void reserve( blkcnt_t blockCount );
-    /// straight chain
+    /// straight chain; last is exclusive. Kept as a run, not per cluster
     void setLine( blkcnt_t curFirst, blkcnt_t curLast );
     /// first is exclusive
     void shadow( blkcnt_t curFirst );
@@ -204,15 +204,23 @@ struct VFatMedium : public RuleMedium
     void setNext( blkcnt_t lastPrev, blkcnt_t firstNext );
     /// last is inclusive
     void setLast( blkcnt_t lastLast );
+    /// sort the runs and the chain breaks; needed before writing
+    void seal();
 
     inline size_t chunkSize() const override { return _chunk_size; }
     inline blksize_t blockSize() const override;
     void fill( void * chunk, off64_t offset, size_t size ) const override;
 
+protected:
+    off64_t constant( const Range & range, uint8_t & value ) const override;
+
 private:
+    typedef std::pair<blkcnt_t, blkcnt_t> Line; ///< [first, last) clusters, each linked to the next one
+
     bool _favor_freespace;
     off64_t _total_length;
     blksize_t _chunk_size;
+    std::vector<Line> _lines; ///< sparse partitions only: elsewhere, the fill is one long line
 };
 
 struct VFat32Out : public Volume
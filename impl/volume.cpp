@@ -6,12 +6,20 @@
 
 #include "impl/volume.h"
 
-bool Original::useEntry( const RawDirEnt * entry ) const { return allowName( entry->d_name ); }
+#include <thread>
+
+bool Original::useEntry( const RawDirEnt * entry ) const
+{
+    return allowName( entry->d_name ) && ( _inside != fsRoot.get() || allowTop( entry ) );
+}
 
 void Original::onFolder( PathEntry * folder )
 {
     pathTable.push_back( folder );
+    PathEntry * outside = _inside;
+    _inside = folder;
     folder->traverse();
+    _inside = outside;
     folder->closeFd();
 }
 
@@ -22,6 +30,21 @@ void Original::onFileFd( FileEntry * fEntry )
     chart( layout[fEntry] = locator->resolve( *fEntry ) );
 }
 
+void Original::settle()
+{
+    bool changed = false;
+    locator->review( [this, &changed]( const Extent & source, const ExtentList & fresh )
+    {
+        FileEntry * fEntry = dynamic_cast<FileEntry *>( source.medium.get() );
+        if( fEntry ) { layout[fEntry] = fresh; changed = true; }
+    } );
+    if( !changed ) { return; }
+
+    // stale extents may have been charted: start over
+    reset();
+    for( FileEntry * fEntry : fileTable ) { chart( layout[fEntry] ); }
+}
+
 void Volume::bookSpace( bool scratch, bool scrooge, off64_t extra )
 {
     _scratch = scratch;
@@ -58,6 +81,10 @@ void Volume::represent( Original & tree, Ptr<Burner> outImage, Ptr<Burner> tmpIm
     Planner tmpPlanner( tmpImage );
 
     outPlanner.requestBlockSize( blockSize() );
+    outPlanner.setJobs( _jobs );
+    tmpPlanner.setJobs( _jobs );
+    outPlanner.setUring( _uring );
+    tmpPlanner.setUring( _uring );
 
     // planReserved is called from within plan():
     // the slave cannot request space from master
@@ -65,8 +92,37 @@ void Volume::represent( Original & tree, Ptr<Burner> outImage, Ptr<Burner> tmpIm
     planComplete( tree, outPlanner, tmpPlanner, srcToTrg );
 
     // this is generic converter phase again
-    tmpPlanner.commit();
-    outPlanner.commit();
+    if( outImage->isDirectDevice() )
+    {
+        // the target maps the temporary medium rather than copying it,
+        // so the medium only has to be sized before the mapping,
+        // and its constant blocks needn't be written more than once
+        if( _dedup_targets ) { Planner::dedup( outPlanner, tmpPlanner, _dedup_targets ); }
+        tmpPlanner.reserve();
+        if( tmpImage->isDirectDevice() )
+        {
+            // the table is built and loaded while the metadata are written, but the target
+            // only goes live once they are synced: early readers (udev, blkid probing the
+            // new device) would otherwise see, and might cache, a half-written filesystem
+            outImage->deferPublish();
+            std::thread tmpCommit( [&tmpPlanner]() { tmpPlanner.commit(); } );
+            outPlanner.commit();
+            tmpCommit.join();
+            outImage->publish();
+        }
+        else
+        {
+            // a file is mapped through its blocks (see Medium::locate()),
+            // which are only final once it's written and synced
+            tmpPlanner.commit();
+            outPlanner.commit();
+        }
+    }
+    else
+    {
+        tmpPlanner.commit();
+        outPlanner.commit();
+    }
 
     // trim(); // TODO!
 }
@@ -15,6 +15,7 @@
 #include "impl/source.h"
 #include "impl/device.h"
 #include "impl/unique.h"
+#include "impl/worker.h"
 
 // Proposed return codes...
 constexpr const int kCantOpenRootFolder = -1;
@@ -35,6 +36,10 @@ struct Original : public Hierarchy, public Geometry
     /// Should at least accept well-formed UTF-8...
     Predicate<const char *> allowName = []( const char * ) { return true; };
 
+    /// A validator of the entries found directly in the root folder. Used to
+    /// split a tree into shards by top-level folder. Default is "allow all".
+    Predicate<const RawDirEnt *> allowTop = []( const RawDirEnt * ) { return true; };
+
     /// Allow or bypass a directory entry based on its name.
     bool useEntry( const RawDirEnt * entry ) const override;
 
@@ -44,14 +49,74 @@ struct Original : public Hierarchy, public Geometry
     /// When a regular file is encountered, resolve its extents and NOT close its fd.
     void onFileFd( FileEntry * fEntry ) override;
 
+    /// Let the locator re-resolve the files whose extents weren't final during
+    /// the traversal, patch their layout and re-chart the source area.
+    /// Must be called after the traversal and before planning.
+    void settle();
+
     // byproducts
     Index<PathEntry> pathTable; ///< This will become e.g. a CDFS PathTable
     Index<FileEntry> fileTable; ///< This will become the file area.
 
     // byproducts
     std::map<Entry *, ExtentList> layout; ///< Source Extent map. Only files, not folders.
+
+private:
+    PathEntry * _inside = nullptr; ///< the folder being traversed
+};
+
+/// The ".." entries (of type D) of the directories staged before their parent,
+/// to be amended in place once the parent is laid out. Directories are written
+/// leaf to root, so each parent settles the links of all its children at once.
+template <typename D>
+struct BackLinks
+{
+    /// Remember the ".." entry at the offset of a staged directory of a parent.
+    void add( PathEntry * parent, Ptr<Medium> dir, off64_t offset ) { _links[parent].push_back( { dir, offset } ); }
+
+    /// Amend the ".." entries pointing at the parent with amend( D & ) and forget them.
+    template <typename F>
+    void settle( PathEntry * parent, F amend )
+    {
+        auto itr = _links.find( parent );
+        if( itr == _links.end() ) { return; }
+        for( auto & link : itr->second ) { amend( *( D * )( ( char * ) link.first->data() + link.second ) ); }
+        _links.erase( itr );
+    }
+
+private:
+    std::map<PathEntry *, std::vector<std::pair<Ptr<Medium>, off64_t>>> _links;
 };
 
+/// Lay out the directories of a path table leaf to root in two phases. First,
+/// encode() composes the records of each directory into a draft of type D; a
+/// draft doesn't depend on where any directory is placed, so drafts are composed
+/// in parallel by jobs threads (zero: one per CPU core). Then place() places the
+/// drafts in order, patching the links that depend on the placement, e.g. to the
+/// subdirectories, placed before. The drafts are composed a window at a time.
+template <typename D>
+void DraftFolders( const Index<PathEntry> & pathTable, unsigned jobs,
+                   std::function<void( PathEntry *, D & )> encode,
+                   std::function<void( PathEntry *, D & )> place )
+{
+    std::vector<PathEntry *> order( pathTable.rbegin(), pathTable.rend() );
+    Workers workers( jobs );
+    const size_t window = 64 * workers.size();
+    for( size_t first = 0; first < order.size(); first += window )
+    {
+        std::vector<D> drafts( std::min( window, order.size() - first ) );
+        for( size_t i = 0; i < drafts.size(); ++i )
+        {
+            PathEntry * pDir = order[first + i];
+            D & draft = drafts[i];
+            if( workers.size() > 1 ) { workers.post( [pDir, &draft, &encode]() { encode( pDir, draft ); } ); }
+            else { encode( pDir, draft ); }
+        }
+        workers.drain();
+        for( size_t i = 0; i < drafts.size(); ++i ) { place( order[first + i], drafts[i] ); }
+    }
+}
+
 /// This interface is co-implemented by Volume\s that describe *the same file area* in an
 /// alternative way. Example: a "monster CD" that's both an HFS+ (Mac) and a CDFS volume.
 /// Planning such "slave" volumes is subject to constraints coming from the master volume
@@ -114,6 +179,15 @@ struct Volume : public Blocks
     /// Set the originating OS name and the volume name, sanitizing the inputss.
     void setTitles( const char * system, const char * volume );
 
+    /// Set the number of threads writing the output and temporary media (zero: one per CPU core).
+    void setJobs( unsigned jobs ) { _jobs = jobs; }
+
+    /// Write the output and temporary media through io_uring, if the kernel allows.
+    void setUring( bool uring ) { _uring = uring; }
+
+    /// Set the most extra targets a mapped output may spend on constant metadata blocks (zero: none).
+    void setDedup( size_t maxTargets ) { _dedup_targets = maxTargets; }
+
     /// The "workhorse" method: lay out a source file tree on the output device
     /// using the temporary device for on-the-fly generated filesystem metadata.
     void represent( Original & tree, Ptr<Burner> outImage, Ptr<Burner> tmpImage );
@@ -147,6 +221,9 @@ protected: // abstract
     bool _scratch = false; ///< writable/temporary partition, favor free space in allocation tables
     bool _scrooge = false; ///< claim as much free space as possible. ***not implemented yet (no use case) ***
     off64_t xtraRoom = 0L; ///< a hint how much room to reserve. (may reserve more.)
+    unsigned _jobs = 0;    ///< writer threads per medium
+    bool _uring = false;   ///< write through io_uring
+    size_t _dedup_targets = 0; ///< constant block mapping budget, see Planner::dedup()
 
     Hybrid * hybrid = nullptr;
 };
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#include "worker.h"
+
+namespace
+{
+thread_local bool tWorker = false; ///< see Workers::Inside()
+}
+
+Workers::Workers( unsigned count ) : _count( count )
+{
+    if( !_count ) { _count = std::max( 1u, std::thread::hardware_concurrency() ); }
+}
+
+Workers::~Workers()
+{
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        _closing = true;
+    }
+    _wake.notify_all();
+    for( auto & thread : _threads ) { thread.join(); }
+}
+
+void Workers::post( Job job )
+{
+    {
+        std::lock_guard<std::mutex> lock( _guard );
+        _jobs.push_back( std::move( job ) );
+        if( _threads.size() < _count && _threads.size() < _jobs.size() + _busy )
+        { _threads.emplace_back( &Workers::run, this ); }
+    }
+    _wake.notify_one();
+}
+
+void Workers::drain()
+{
+    std::unique_lock<std::mutex> lock( _guard );
+    _idle.wait( lock, [this]() { return _jobs.empty() && !_busy; } );
+}
+
+bool Workers::Inside() { return tWorker; }
+
+void Workers::run()
+{
+    tWorker = true;
+    std::unique_lock<std::mutex> lock( _guard );
+    while( true )
+    {
+        _wake.wait( lock, [this]() { return _closing || !_jobs.empty(); } );
+        if( _jobs.empty() ) { return; } // closing
+        Job job = std::move( _jobs.front() );
+        _jobs.pop_front();
+        ++_busy;
+        lock.unlock();
+
+        job();
+
+        lock.lock();
+        if( !--_busy && _jobs.empty() ) { _idle.notify_all(); }
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Light Labs Inc.
+ * All Rights Reserved
+ * Licensed under the MIT license.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "wrapper.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/// A fixed pool of threads running posted jobs in the FIFO order.
+/// Threads are started lazily on the first post() and joined on destruction.
+struct Workers
+{
+    typedef std::function<void()> Job;
+
+    /// Create a pool of count threads (zero: one per CPU core).
+    explicit Workers( unsigned count = 0 );
+    ~Workers();
+
+    /// Queue a job. Jobs may post further jobs.
+    void post( Job job );
+
+    /// Wait until all the posted jobs (including those they posted) have completed.
+    void drain();
+
+    /// Return the number of threads in the pool.
+    unsigned size() const { return _count; }
+
+    /// Whether the calling thread is a worker of a pool. Work nested in a job should
+    /// then run inline: the pool is the parallelism its owner has budgeted for.
+    static bool Inside();
+
+private:
+    void run();
+
+    unsigned _count;
+    std::vector<std::thread> _threads;
+    std::mutex _guard;
+    std::condition_variable _wake; ///< a job is queued, or the pool is closing
+    std::condition_variable _idle; ///< the queue is empty and no job is running
+    std::deque<Job> _jobs;
+    size_t _busy = 0;
+    bool _closing = false;
+};
+
+#endif // WORKER_H